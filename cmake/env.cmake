@@ -9,6 +9,17 @@ set(EXECUTABLE_OUTPUT_PATH ${PROJECT_BINARY_DIR}/bin)
 IF (NOT WIN32)
 set(CMAKE_CXX_FLAGS "--std=c++14 -g")
 ENDIF ()
+# Lets the SIMD box tests use AVX (or whatever else the build host has)
+OPTION(RAY_NATIVE_ARCH "Compile for the instruction set of this machine" OFF)
+IF (RAY_NATIVE_ARCH AND NOT WIN32)
+	SET(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -march=native")
+ENDIF ()
+# Replaces the global operator new so -b can count the allocations made
+# while tracing; see src/allocCounter.h
+OPTION(RAY_COUNT_ALLOCS "Count allocations for the -b statistics" OFF)
+IF (RAY_COUNT_ALLOCS)
+	ADD_DEFINITIONS(-DRAY_COUNT_ALLOCS)
+ENDIF ()
 
 # Packages
 FIND_PACKAGE(OpenGL REQUIRED)
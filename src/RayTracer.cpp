@@ -38,6 +38,8 @@ glm::dvec3 RayTracer::trace(double x, double y)
 	// Clear out the ray cache in the scene for debugging purposes,
 	if (TraceUI::m_debug)
 		scene->intersectCache.clear();
+	// nothing is left of the hits of the previous ray
+	hit_materials::clear();
 
 	ray r(glm::dvec3(0,0,0), glm::dvec3(0,0,0), glm::dvec3(1,1,1), ray::VISIBILITY);
 	scene->getCamera().rayThrough(x,y,r);
@@ -250,6 +252,9 @@ void RayTracer::traceSetup(int w, int h)
 	samples = traceUI->getSuperSamples();
 	aaThresh = traceUI->getAaThreshold();
 
+	// a rebuild finished since the last update is worth having
+	if (sceneLoaded())
+		scene->pollRebuild();
 }
 
 /*
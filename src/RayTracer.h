@@ -201,7 +201,7 @@ public:
 		@brief Gets a pointer to our scene 
 		@return the pointer to our scene object
 	*/	
-	const Scene& getScene() { return *scene; }
+	Scene& getScene() { return *scene; }
 
 	bool stopTrace;
 
@@ -6,8 +6,6 @@
 
 using namespace std;
 
-const double HUGE_DOUBLE = 1e100;
-
 bool Box::intersectLocal(ray& r, isect& i) const
 {
         glm::dvec3 p = r.getPosition();
@@ -18,7 +16,8 @@ bool Box::intersectLocal(ray& r, isect& i) const
         double x, y, t, bestT; 
         int mod0, mod1, mod2, bestIndex;
 
-        bestT = HUGE_DOUBLE;
+        // faces beyond the ray's interval are as good as missed
+        bestT = r.getTMax();
         bestIndex = -1;
 
         for(it=0; it<6; it++){ 
@@ -52,9 +51,9 @@ bool Box::intersectLocal(ray& r, isect& i) const
 
         if(bestIndex < 0) return false;
         
+        r.setTMax(bestT);
         i.setT(bestT);
         i.setObject(this);
-		i.setMaterial(this->getMaterial());
 
 		//glm::dvec3 intersect_point = r.at((float)i.t);
 		glm::dvec3 intersect_point = r.at(i);
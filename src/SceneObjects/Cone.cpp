@@ -93,12 +93,12 @@ bool Cone::intersectLocal(ray& r, isect& i) const
 		}
 	}
 	
-	if(theRoot <= RAY_EPSILON) return false;
+	if(theRoot <= RAY_EPSILON || theRoot > r.getTMax()) return false;
 	
+	r.setTMax(theRoot);
 	i.setT(theRoot);
 	i.setN(glm::normalize(normal));
 	i.setObject(this);
-	i.setMaterial(this->getMaterial());
 	return true;
 	
 	return ret;
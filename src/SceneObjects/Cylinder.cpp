@@ -9,21 +9,26 @@ bool Cylinder::intersectLocal(ray& r, isect& i) const
 {
 	// FIXME: check these suspicious initialization.
 	i.setObject(this);
-	i.setMaterial(this->getMaterial());
 
+	bool hit;
 	if( intersectCaps( r, i ) ) {
 		isect ii;
 		if( intersectBody( r, ii ) ) {
 			if( ii.getT() < i.getT() ) {
 				i = ii;
 				i.setObject(this);
-				i.setMaterial(this->getMaterial());
 			}
 		}
-		return true;
+		hit = true;
 	} else {
-		return intersectBody( r, i );
+		hit = intersectBody( r, i );
+	}
+
+	if( !hit || i.getT() > r.getTMax() ) {
+		return false;
 	}
+	r.setTMax(i.getT());
+	return true;
 }
 
 bool Cylinder::intersectBody( const ray& r, isect& i ) const
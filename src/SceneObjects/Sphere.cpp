@@ -24,19 +24,36 @@ bool Sphere::intersectLocal(ray& r, isect& i) const
 		return false;
 	}
 
-	i.setObject(this);
-	i.setMaterial(this->getMaterial());
-
 	double t1 = b - discriminant;
+	double t = t1 > RAY_EPSILON ? t1 : t2;
 
-	if( t1 > RAY_EPSILON ) {
-		i.setT(t1);
-		i.setN(glm::normalize(r.at( t1 )));
-	} else {
-		i.setT(t2);
-		i.setN(glm::normalize(r.at( t2 )));
+	if( t > r.getTMax() ) {
+		return false;
 	}
 
+	i.setObject(this);
+	i.setT(t);
+	i.setN(glm::normalize(r.at( t )));
+	r.setTMax(t);
+
 	return true;
 }
 
+bool Sphere::occludedLocal(ray& r) const
+{
+	// same as intersectLocal(), without filling in the hit
+	glm::dvec3 d = glm::normalize(r.getDirection());
+	glm::dvec3 v = -r.getPosition();
+	double b = glm::dot(v, d);
+	double discriminant = b*b - glm::dot(v,v) + 1;
+
+	if( discriminant < 0.0 ) {
+		return false;
+	}
+
+	discriminant = sqrt( discriminant );
+	double t1 = b - discriminant;
+	double t2 = b + discriminant;
+	double t = t1 > RAY_EPSILON ? t1 : t2;
+	return t > RAY_EPSILON && t <= r.getTMax();
+}
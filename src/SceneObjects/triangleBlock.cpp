@@ -0,0 +1,412 @@
+#include "triangleBlock.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <vector>
+#include <glm/glm.hpp>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "trimesh.h"
+
+template <class Real>
+const int TriangleBlock<Real>::kWidth;
+
+namespace {
+using triangle_block::kWidth;
+
+// Float hits closer than this, relative to the largest coordinate of the
+// block, are dropped.  A ray leaving a face starts a few float roundings
+// off it, and this leaves room for that down to grazing angles.
+const double kFloatEpsilon = 1.0 / 65536;
+
+double minDistance(double, double)
+{
+	return RAY_EPSILON;
+}
+
+double minDistance(float, double scale)
+{
+	return kFloatEpsilon * scale;
+}
+
+// The watertight test of Trimesh::hitFace() for every lane, one at a time.
+// Fills in the results of the lanes hit and returns their mask.
+template <class Real>
+int scalarLanes(const Real corner[3][3][kWidth], const ray &r, Real epsilon,
+                Real tl[], Real ul[], Real vl[], Real wl[])
+{
+	const int kx = r.getShearAxis(0);
+	const int ky = r.getShearAxis(1);
+	const int kz = r.getShearAxis(2);
+	const Real S[3] = {Real(r.getShear()[0]), Real(r.getShear()[1]),
+	                   Real(r.getShear()[2])};
+	const glm::dvec3 pos = r.getPosition();
+	const Real org[3] = {Real(pos[0]), Real(pos[1]), Real(pos[2])};
+	const Real tmax = Real(r.getTMax());
+	int mask = 0;
+	for (int lane = 0; lane < kWidth; lane++) {
+		Real X[3], Y[3], Z[3];
+		for (int c = 0; c < 3; c++) {
+			Z[c] = corner[c][kz][lane] - org[kz];
+			X[c] = (corner[c][kx][lane] - org[kx]) - S[0] * Z[c];
+			Y[c] = (corner[c][ky][lane] - org[ky]) - S[1] * Z[c];
+			Z[c] = S[2] * Z[c];
+		}
+		Real U = X[2] * Y[1] - Y[2] * X[1];
+		Real V = X[0] * Y[2] - Y[0] * X[2];
+		Real W = X[1] * Y[0] - Y[1] * X[0];
+		if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0))
+			continue;
+		Real det = U + V + W;
+		if (det == 0)
+			continue;
+		Real T = U * Z[0] + V * Z[1] + W * Z[2];
+		Real sign = det < 0 ? -1 : 1;
+		if (T * sign <= epsilon * det * sign || T * sign > tmax * det * sign)
+			continue;
+		Real invDet = 1 / det;
+		tl[lane] = T * invDet;
+		ul[lane] = U * invDet;
+		vl[lane] = V * invDet;
+		wl[lane] = W * invDet;
+		mask |= 1 << lane;
+	}
+	return mask;
+}
+
+// the same for doubles, one AVX register or two SSE2 registers at a time
+int testLanes(const double corner[3][3][kWidth], const ray &r,
+              double epsilon, double tl[], double ul[], double vl[],
+              double wl[])
+{
+#if defined(__AVX__)
+	const int kx = r.getShearAxis(0);
+	const int ky = r.getShearAxis(1);
+	const int kz = r.getShearAxis(2);
+	const glm::dvec3 &S = r.getShear();
+	const glm::dvec3 org = r.getPosition();
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d signBit = _mm256_set1_pd(-0.0);
+	const __m256d sx = _mm256_set1_pd(S[0]);
+	const __m256d sy = _mm256_set1_pd(S[1]);
+	const __m256d sz = _mm256_set1_pd(S[2]);
+	__m256d X[3], Y[3], Z[3];
+	for (int c = 0; c < 3; c++) {
+		Z[c] = _mm256_sub_pd(_mm256_loadu_pd(corner[c][kz]), _mm256_set1_pd(org[kz]));
+		X[c] = _mm256_sub_pd(_mm256_sub_pd(_mm256_loadu_pd(corner[c][kx]), _mm256_set1_pd(org[kx])),
+		                     _mm256_mul_pd(sx, Z[c]));
+		Y[c] = _mm256_sub_pd(_mm256_sub_pd(_mm256_loadu_pd(corner[c][ky]), _mm256_set1_pd(org[ky])),
+		                     _mm256_mul_pd(sy, Z[c]));
+		Z[c] = _mm256_mul_pd(sz, Z[c]);
+	}
+	__m256d U = _mm256_sub_pd(_mm256_mul_pd(X[2], Y[1]), _mm256_mul_pd(Y[2], X[1]));
+	__m256d V = _mm256_sub_pd(_mm256_mul_pd(X[0], Y[2]), _mm256_mul_pd(Y[0], X[2]));
+	__m256d W = _mm256_sub_pd(_mm256_mul_pd(X[1], Y[0]), _mm256_mul_pd(Y[1], X[0]));
+	__m256d neg = _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(U, zero, _CMP_LT_OQ),
+	                                        _mm256_cmp_pd(V, zero, _CMP_LT_OQ)),
+	                           _mm256_cmp_pd(W, zero, _CMP_LT_OQ));
+	__m256d pos = _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(U, zero, _CMP_GT_OQ),
+	                                        _mm256_cmp_pd(V, zero, _CMP_GT_OQ)),
+	                           _mm256_cmp_pd(W, zero, _CMP_GT_OQ));
+	__m256d det = _mm256_add_pd(_mm256_add_pd(U, V), W);
+	__m256d T = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(U, Z[0]), _mm256_mul_pd(V, Z[1])),
+	                          _mm256_mul_pd(W, Z[2]));
+	__m256d sign = _mm256_and_pd(det, signBit);
+	__m256d Ts = _mm256_xor_pd(T, sign);
+	__m256d detAbs = _mm256_xor_pd(det, sign);
+	__m256d ok = _mm256_andnot_pd(_mm256_and_pd(neg, pos), _mm256_cmp_pd(det, zero, _CMP_NEQ_OQ));
+	ok = _mm256_and_pd(ok, _mm256_cmp_pd(Ts, _mm256_mul_pd(_mm256_set1_pd(epsilon), detAbs), _CMP_GT_OQ));
+	ok = _mm256_and_pd(ok, _mm256_cmp_pd(Ts, _mm256_mul_pd(_mm256_set1_pd(r.getTMax()), detAbs), _CMP_LE_OQ));
+	int mask = _mm256_movemask_pd(ok);
+	if (!mask)
+		return 0;
+	__m256d invDet = _mm256_div_pd(_mm256_set1_pd(1.0), det);
+	_mm256_storeu_pd(tl, _mm256_mul_pd(T, invDet));
+	_mm256_storeu_pd(ul, _mm256_mul_pd(U, invDet));
+	_mm256_storeu_pd(vl, _mm256_mul_pd(V, invDet));
+	_mm256_storeu_pd(wl, _mm256_mul_pd(W, invDet));
+	return mask;
+#elif defined(__SSE2__)
+	const int kx = r.getShearAxis(0);
+	const int ky = r.getShearAxis(1);
+	const int kz = r.getShearAxis(2);
+	const glm::dvec3 &S = r.getShear();
+	const glm::dvec3 org = r.getPosition();
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d signBit = _mm_set1_pd(-0.0);
+	const __m128d sx = _mm_set1_pd(S[0]);
+	const __m128d sy = _mm_set1_pd(S[1]);
+	const __m128d sz = _mm_set1_pd(S[2]);
+	int mask = 0;
+	for (int half = 0; half < kWidth; half += 2) {
+		__m128d X[3], Y[3], Z[3];
+		for (int c = 0; c < 3; c++) {
+			Z[c] = _mm_sub_pd(_mm_loadu_pd(corner[c][kz] + half), _mm_set1_pd(org[kz]));
+			X[c] = _mm_sub_pd(_mm_sub_pd(_mm_loadu_pd(corner[c][kx] + half), _mm_set1_pd(org[kx])),
+			                  _mm_mul_pd(sx, Z[c]));
+			Y[c] = _mm_sub_pd(_mm_sub_pd(_mm_loadu_pd(corner[c][ky] + half), _mm_set1_pd(org[ky])),
+			                  _mm_mul_pd(sy, Z[c]));
+			Z[c] = _mm_mul_pd(sz, Z[c]);
+		}
+		__m128d U = _mm_sub_pd(_mm_mul_pd(X[2], Y[1]), _mm_mul_pd(Y[2], X[1]));
+		__m128d V = _mm_sub_pd(_mm_mul_pd(X[0], Y[2]), _mm_mul_pd(Y[0], X[2]));
+		__m128d W = _mm_sub_pd(_mm_mul_pd(X[1], Y[0]), _mm_mul_pd(Y[1], X[0]));
+		__m128d neg = _mm_or_pd(_mm_or_pd(_mm_cmplt_pd(U, zero), _mm_cmplt_pd(V, zero)),
+		                        _mm_cmplt_pd(W, zero));
+		__m128d pos = _mm_or_pd(_mm_or_pd(_mm_cmpgt_pd(U, zero), _mm_cmpgt_pd(V, zero)),
+		                        _mm_cmpgt_pd(W, zero));
+		__m128d det = _mm_add_pd(_mm_add_pd(U, V), W);
+		__m128d T = _mm_add_pd(_mm_add_pd(_mm_mul_pd(U, Z[0]), _mm_mul_pd(V, Z[1])),
+		                       _mm_mul_pd(W, Z[2]));
+		__m128d sign = _mm_and_pd(det, signBit);
+		__m128d Ts = _mm_xor_pd(T, sign);
+		__m128d detAbs = _mm_xor_pd(det, sign);
+		__m128d ok = _mm_andnot_pd(_mm_and_pd(neg, pos), _mm_cmpneq_pd(det, zero));
+		ok = _mm_and_pd(ok, _mm_cmpgt_pd(Ts, _mm_mul_pd(_mm_set1_pd(epsilon), detAbs)));
+		ok = _mm_and_pd(ok, _mm_cmple_pd(Ts, _mm_mul_pd(_mm_set1_pd(r.getTMax()), detAbs)));
+		int halfMask = _mm_movemask_pd(ok);
+		if (!halfMask)
+			continue;
+		mask |= halfMask << half;
+		__m128d invDet = _mm_div_pd(_mm_set1_pd(1.0), det);
+		_mm_storeu_pd(tl + half, _mm_mul_pd(T, invDet));
+		_mm_storeu_pd(ul + half, _mm_mul_pd(U, invDet));
+		_mm_storeu_pd(vl + half, _mm_mul_pd(V, invDet));
+		_mm_storeu_pd(wl + half, _mm_mul_pd(W, invDet));
+	}
+	return mask;
+#else
+	return scalarLanes(corner, r, epsilon, tl, ul, vl, wl);
+#endif
+}
+
+// the same for floats, all four lanes in one SSE register
+int testLanes(const float corner[3][3][kWidth], const ray &r, float epsilon,
+              float tl[], float ul[], float vl[], float wl[])
+{
+#if defined(__SSE2__)
+	const int kx = r.getShearAxis(0);
+	const int ky = r.getShearAxis(1);
+	const int kz = r.getShearAxis(2);
+	const glm::dvec3 &S = r.getShear();
+	const glm::dvec3 org = r.getPosition();
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 signBit = _mm_set1_ps(-0.0f);
+	const __m128 sx = _mm_set1_ps(float(S[0]));
+	const __m128 sy = _mm_set1_ps(float(S[1]));
+	const __m128 sz = _mm_set1_ps(float(S[2]));
+	__m128 X[3], Y[3], Z[3];
+	for (int c = 0; c < 3; c++) {
+		Z[c] = _mm_sub_ps(_mm_loadu_ps(corner[c][kz]), _mm_set1_ps(float(org[kz])));
+		X[c] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(corner[c][kx]), _mm_set1_ps(float(org[kx]))),
+		                  _mm_mul_ps(sx, Z[c]));
+		Y[c] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(corner[c][ky]), _mm_set1_ps(float(org[ky]))),
+		                  _mm_mul_ps(sy, Z[c]));
+		Z[c] = _mm_mul_ps(sz, Z[c]);
+	}
+	__m128 U = _mm_sub_ps(_mm_mul_ps(X[2], Y[1]), _mm_mul_ps(Y[2], X[1]));
+	__m128 V = _mm_sub_ps(_mm_mul_ps(X[0], Y[2]), _mm_mul_ps(Y[0], X[2]));
+	__m128 W = _mm_sub_ps(_mm_mul_ps(X[1], Y[0]), _mm_mul_ps(Y[1], X[0]));
+	__m128 neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)),
+	                       _mm_cmplt_ps(W, zero));
+	__m128 pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)),
+	                       _mm_cmpgt_ps(W, zero));
+	__m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+	__m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, Z[0]), _mm_mul_ps(V, Z[1])),
+	                      _mm_mul_ps(W, Z[2]));
+	__m128 sign = _mm_and_ps(det, signBit);
+	__m128 Ts = _mm_xor_ps(T, sign);
+	__m128 detAbs = _mm_xor_ps(det, sign);
+	__m128 ok = _mm_andnot_ps(_mm_and_ps(neg, pos), _mm_cmpneq_ps(det, zero));
+	ok = _mm_and_ps(ok, _mm_cmpgt_ps(Ts, _mm_mul_ps(_mm_set1_ps(epsilon), detAbs)));
+	ok = _mm_and_ps(ok, _mm_cmple_ps(Ts, _mm_mul_ps(_mm_set1_ps(float(r.getTMax())), detAbs)));
+	int mask = _mm_movemask_ps(ok);
+	if (!mask)
+		return 0;
+	__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+	_mm_storeu_ps(tl, _mm_mul_ps(T, invDet));
+	_mm_storeu_ps(ul, _mm_mul_ps(U, invDet));
+	_mm_storeu_ps(vl, _mm_mul_ps(V, invDet));
+	_mm_storeu_ps(wl, _mm_mul_ps(W, invDet));
+	return mask;
+#else
+	return scalarLanes(corner, r, epsilon, tl, ul, vl, wl);
+#endif
+}
+}
+
+template <class Real>
+TriangleBlock<Real>::TriangleBlock(const Trimesh *m, const uint32_t *f, int n)
+        : mesh(m), count(n)
+{
+	double scale = 0.0;
+	for (int lane = 0; lane < kWidth; lane++) {
+		faces[lane] = lane < n ? f[lane] : 0;
+		for (int c = 0; c < 3; c++) {
+			glm::dvec3 v = lane < n ? mesh->vertices[mesh->faces[f[lane]].ids[c]]
+			                        : glm::dvec3(0.0);
+			for (int axis = 0; axis < 3; axis++) {
+				corner[c][axis][lane] = Real(v[axis]);
+				scale = std::max(scale, std::abs(v[axis]));
+			}
+		}
+	}
+	epsilon = Real(minDistance(Real(), scale));
+	// around the corners as stored, which may have been rounded
+	glm::dvec3 lo(corner[0][0][0], corner[0][1][0], corner[0][2][0]);
+	glm::dvec3 hi = lo;
+	for (int lane = 0; lane < n; lane++) {
+		for (int c = 0; c < 3; c++) {
+			glm::dvec3 v(corner[c][0][lane], corner[c][1][lane], corner[c][2][lane]);
+			lo = glm::min(lo, v);
+			hi = glm::max(hi, v);
+		}
+	}
+	bounds = BoundingBox(lo, hi);
+}
+
+template <class Real>
+bool TriangleBlock<Real>::intersect(ray &r, isect &i) const
+{
+	double t, m1, m2, m3;
+	int lane = hit(r, t, m1, m2, m3);
+	if (lane < 0)
+		return false;
+	mesh->setHit(i, faces[lane], t, m1, m2, m3);
+	r.setTMax(t);
+	return true;
+}
+
+template <class Real>
+bool TriangleBlock<Real>::occluded(ray &r) const
+{
+	double t, m1, m2, m3;
+	return hit(r, t, m1, m2, m3) >= 0;
+}
+
+template <class Real>
+bool TriangleBlock<Real>::clipBounds(const BoundingBox &region,
+                                     glm::dvec3 &lo, glm::dvec3 &hi) const
+{
+	bool any = false;
+	glm::dvec3 blo, bhi;
+	for (int lane = 0; lane < count; lane++) {
+		BoundingBox b = mesh->faceBounds(faces[lane]);
+		glm::dvec3 a = glm::max(b.getMin(), region.getMin());
+		glm::dvec3 c = glm::min(b.getMax(), region.getMax());
+		if (a[0] > c[0] || a[1] > c[1] || a[2] > c[2] ||
+		    !mesh->clipFace(faces[lane], region, a, c))
+			continue;
+		blo = any ? glm::min(blo, a) : a;
+		bhi = any ? glm::max(bhi, c) : c;
+		any = true;
+	}
+	if (!any)
+		return false;
+	// rounded corners may lie a little outside the exact faces
+	if (sizeof(Real) < sizeof(double)) {
+		blo -= glm::dvec3(epsilon);
+		bhi += glm::dvec3(epsilon);
+	}
+	lo = glm::max(lo, blo);
+	hi = glm::min(hi, bhi);
+	return true;
+}
+
+template <class Real>
+int TriangleBlock<Real>::hit(const ray &r, double &t, double &m1, double &m2,
+                             double &m3) const
+{
+	// per lane results, valid where mask is set
+	Real tl[kWidth], ul[kWidth], vl[kWidth], wl[kWidth];
+	int mask = testLanes(corner, r, epsilon, tl, ul, vl, wl);
+	int best = -1;
+	for (int lane = 0; lane < kWidth; lane++)
+		if ((mask >> lane & 1) && (best < 0 || tl[lane] < tl[best]))
+			best = lane;
+	if (best < 0)
+		return -1;
+	t = tl[best];
+	m1 = ul[best];
+	m2 = vl[best];
+	m3 = wl[best];
+	return best;
+}
+
+template class TriangleBlock<double>;
+template class TriangleBlock<float>;
+
+void benchmarkTriangleTests(std::ostream &out)
+{
+	const int kTriangles = 4096;
+	const int kRays = 256;
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<double> coord(-1.0, 1.0);
+	auto point = [&] {
+		return glm::dvec3(coord(rng), coord(rng), coord(rng));
+	};
+
+	Trimesh mesh(nullptr, new Material(), nullptr);
+	for (int k = 0; k < kTriangles; k++) {
+		glm::dvec3 c = point();
+		for (int v = 0; v < 3; v++)
+			mesh.addVertex(c + 0.1 * point());
+		mesh.addFace(3 * k, 3 * k + 1, 3 * k + 2);
+	}
+	std::vector<uint32_t> faces(mesh.faces.size());
+	for (uint32_t f = 0; f < faces.size(); f++)
+		faces[f] = f;
+	std::vector<TriangleBlock<double>> blocks;
+	std::vector<TriangleBlock<float>> floatBlocks;
+	for (std::size_t k = 0; k < faces.size(); k += kWidth) {
+		int n = std::min<int>(kWidth, faces.size() - k);
+		blocks.emplace_back(&mesh, faces.data() + k, n);
+		floatBlocks.emplace_back(&mesh, faces.data() + k, n);
+	}
+	std::vector<ray> rays;
+	for (int k = 0; k < kRays; k++)
+		rays.emplace_back(3.0 * point(), glm::normalize(point()),
+		                  glm::dvec3(1.0), ray::VISIBILITY);
+
+	// the hit counts keep the loops from being optimized away
+	double t, m1, m2, m3;
+	std::size_t hits = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (const auto &r : rays)
+		for (uint32_t f : faces)
+			hits += mesh.hitFace(f, r, t, m1, m2, m3);
+	std::chrono::duration<double> faceTime = std::chrono::steady_clock::now() - start;
+	start = std::chrono::steady_clock::now();
+	for (const auto &r : rays)
+		for (const auto &block : blocks)
+			hits += block.hit(r, t, m1, m2, m3) >= 0;
+	std::chrono::duration<double> blockTime = std::chrono::steady_clock::now() - start;
+	start = std::chrono::steady_clock::now();
+	for (const auto &r : rays)
+		for (const auto &block : floatBlocks)
+			hits += block.hit(r, t, m1, m2, m3) >= 0;
+	std::chrono::duration<double> floatTime = std::chrono::steady_clock::now() - start;
+
+	double tests = double(faces.size()) * rays.size();
+#if defined(__AVX__)
+	const char *kernel = "AVX";
+#elif defined(__SSE2__)
+	const char *kernel = "SSE2";
+#else
+	const char *kernel = "scalar";
+#endif
+#if defined(__SSE2__)
+	const char *floatKernel = "SSE";
+#else
+	const char *floatKernel = "scalar";
+#endif
+	out << "triangle: " << faceTime.count() / tests * 1e9 << " ns single, "
+	    << blockTime.count() / tests * 1e9 << " ns in blocks of "
+	    << kWidth << " (" << kernel << "), "
+	    << floatTime.count() / tests * 1e9 << " ns in float blocks ("
+	    << floatKernel << ")" << (hits ? "" : ", nothing hit") << std::endl;
+}
@@ -0,0 +1,86 @@
+#ifndef TRIANGLE_BLOCK_H__
+#define TRIANGLE_BLOCK_H__
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "../scene/accelerator.h"
+#include "../scene/bbox.h"
+#include "../scene/ray.h"
+
+class Trimesh;
+
+namespace triangle_block {
+const int kWidth = 4;
+}
+
+// Up to four neighbouring faces of a mesh, with their corners stored
+// component by component so one ray is tested against all of them with
+// one AVX (or two SSE2) watertight test.  Meshes build their acceleration
+// structure over these instead of single faces.  Four lanes of doubles
+// fill exactly one AVX register.
+//
+// Real is the precision the corners are kept and tested in.  Blocks of
+// floats ("float_geometry" in the JSON settings) take half the memory and
+// fit one SSE register.  Their distances are only good to float rounding,
+// so they drop hits closer than a small fraction of the mesh's size
+// instead of RAY_EPSILON; otherwise a ray leaving a face could find it
+// again.
+//
+// The corners are copies of the mesh's vertices, so the blocks cost more
+// than the faces themselves: 400 bytes a block of doubles, 248 of floats,
+// or about 100 and 62 bytes per face when blocks are full, against 40 for
+// a TrimeshFace.  -b prints the total per face.
+template <class Real>
+class TriangleBlock {
+public:
+	static const int kWidth = triangle_block::kWidth;
+
+	// faces[0 .. n) of mesh, n at most kWidth
+	TriangleBlock(const Trimesh *mesh, const uint32_t *faces, int n);
+
+	// Intersects the nearest face of the block hit, as a single face
+	// would (see Trimesh::hitFace()).
+	bool intersect(ray &r, isect &i) const;
+	bool occluded(ray &r) const;
+	const BoundingBox &getBoundingBox() const { return bounds; }
+	// the union of what the faces clip themselves to
+	bool clipBounds(const BoundingBox &region, glm::dvec3 &lo,
+	                glm::dvec3 &hi) const;
+
+	int size() const { return count; }
+	uint32_t face(int k) const { return faces[k]; }
+
+	// The test itself: the lane of the nearest face hit in (epsilon,
+	// tmax] and its distance and barycentric coordinates, or -1.  The same
+	// arithmetic as Trimesh::hitFace(), lane by lane, in Real.
+	int hit(const ray &r, double &t, double &m1, double &m2,
+	        double &m3) const;
+
+private:
+	// corner[c][axis][lane].  Unused lanes have all corners at the
+	// origin, which no ray hits.
+	Real corner[3][3][kWidth];
+	const Trimesh *mesh;
+	uint32_t faces[kWidth];
+	int count;
+	// hits up to this distance are dropped
+	Real epsilon;
+	BoundingBox bounds;
+};
+
+extern template class TriangleBlock<double>;
+extern template class TriangleBlock<float>;
+
+// the nodes over float blocks need no more precision than the blocks
+template <>
+struct AccelScalar<TriangleBlock<float> *> {
+	typedef float type;
+};
+
+// Times the single face test against the block tests on random triangles
+// and rays, and prints the cost per triangle (-b).
+void benchmarkTriangleTests(std::ostream &out);
+
+#endif // TRIANGLE_BLOCK_H__
@@ -3,7 +3,11 @@
 #include <float.h>
 #include <string.h>
 #include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <chrono>
 #include <cmath>
+#include "../scene/accelReport.h"
 #include "../ui/TraceUI.h"
 #include "glm/ext.hpp"
 #include <iostream>
@@ -15,8 +19,6 @@ Trimesh::~Trimesh()
 {
 	for (auto m : materials)
 		delete m;
-	for (auto f : faces)
-		delete f;
 }
 
 // must add vertices, normals, and materials IN ORDER
@@ -43,19 +45,225 @@ bool Trimesh::addFace(int a, int b, int c)
 	if (a >= vcnt || b >= vcnt || c >= vcnt)
 		return false;
 
-	TrimeshFace* newFace = new TrimeshFace(
-	        scene, new Material(*this->material), this, a, b, c);
-	newFace->setTransform(this->transform);
-	if (!newFace->degen)
-		faces.push_back(newFace);
-	else
-		delete newFace;
+	// degenerate faces are dropped, no ray hits them
+	const glm::dvec3& va = vertices[a];
+	const glm::dvec3& vb = vertices[b];
+	const glm::dvec3& vc = vertices[c];
+	if (glm::length(vb - va) == 0.0 || glm::length(vc - va) == 0.0 ||
+	    glm::length(vb - vc) == 0.0)
+		return true;
 
 	// Don't add faces to the scene's object list so we can cull by bounding
 	// box
+	TrimeshFace face = {{a, b, c}, glm::normalize(glm::cross(vb - va, vc - va))};
+	faces.push_back(face);
 	return true;
 }
 
+BoundingBox Trimesh::faceBounds(uint32_t f) const
+{
+	const TrimeshFace& face = faces[f];
+	const glm::dvec3& a = vertices[face.ids[0]];
+	const glm::dvec3& b = vertices[face.ids[1]];
+	const glm::dvec3& c = vertices[face.ids[2]];
+	return BoundingBox(glm::min(glm::min(a, b), c), glm::max(glm::max(a, b), c));
+}
+
+namespace {
+// spreads the low 10 bits of v out to every third bit
+uint32_t spreadBits(uint32_t v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+double longestSide(const BoundingBox &b)
+{
+	glm::dvec3 d = b.getMax() - b.getMin();
+	return std::max(d[0], std::max(d[1], d[2]));
+}
+
+// how much longer than its largest face a block may get
+const double kBlockSpread = 2.0;
+}
+
+std::vector<uint32_t> Trimesh::mortonOrder() const
+{
+	std::vector<glm::dvec3> centroids;
+	centroids.reserve(faces.size());
+	BoundingBox box;
+	for (const auto& face : faces) {
+		glm::dvec3 c = (vertices[face.ids[0]] + vertices[face.ids[1]] +
+		                vertices[face.ids[2]]) / 3.0;
+		centroids.push_back(c);
+		box.merge(BoundingBox(c, c));
+	}
+	glm::dvec3 extent = box.getMax() - box.getMin();
+	std::vector<std::pair<uint32_t, uint32_t>> keyed;
+	keyed.reserve(faces.size());
+	for (uint32_t k = 0; k < faces.size(); k++) {
+		uint32_t code = 0;
+		for (int axis = 0; axis < 3; axis++) {
+			double x = extent[axis] > 0.0
+			                   ? (centroids[k][axis] - box.getMin()[axis]) / extent[axis]
+			                   : 0.0;
+			uint32_t cell = (uint32_t)std::min(1023.0, x * 1024.0);
+			code |= spreadBits(cell) << axis;
+		}
+		keyed.emplace_back(code, k);
+	}
+	std::stable_sort(keyed.begin(), keyed.end(),
+	                 [](const std::pair<uint32_t, uint32_t>& a,
+	                    const std::pair<uint32_t, uint32_t>& b) {
+		return a.first < b.first;
+	});
+	std::vector<uint32_t> sorted;
+	sorted.reserve(faces.size());
+	for (const auto& key : keyed)
+		sorted.push_back(key.second);
+	return sorted;
+}
+
+void Trimesh::reorder()
+{
+	if (faces.empty())
+		return;
+	Faces sorted;
+	sorted.reserve(faces.size());
+	for (uint32_t f : mortonOrder())
+		sorted.push_back(faces[f]);
+	faces.swap(sorted);
+
+	// vertices no face uses keep their place in the bounds, at the end
+	std::vector<int> newIndex(vertices.size(), -1);
+	std::vector<int> order;
+	order.reserve(vertices.size());
+	for (const auto& face : faces) {
+		for (int k = 0; k < 3; k++) {
+			int& id = newIndex[face.ids[k]];
+			if (id < 0) {
+				id = order.size();
+				order.push_back(face.ids[k]);
+			}
+		}
+	}
+	for (std::size_t v = 0; v < vertices.size(); v++) {
+		if (newIndex[v] < 0) {
+			newIndex[v] = order.size();
+			order.push_back(v);
+		}
+	}
+	for (auto& face : faces)
+		for (int k = 0; k < 3; k++)
+			face.ids[k] = newIndex[face.ids[k]];
+	auto permute = [&order](auto& values) {
+		if (values.size() != order.size())
+			return;
+		std::remove_reference_t<decltype(values)> sorted;
+		sorted.reserve(values.size());
+		for (int v : order)
+			sorted.push_back(values[v]);
+		values.swap(sorted);
+	};
+	permute(vertices);
+	permute(normals);
+	permute(materials);
+}
+
+void Trimesh::buildKdTree()
+{
+	opaque = !getMaterial().Trans() &&
+	         std::none_of(materials.begin(), materials.end(),
+	                      [](const Material* m) { return m->Trans(); });
+	floatGeometry = traceUI->floatGeometrySwitch();
+	if (floatGeometry) {
+		doubleBlocks = BlockSet<double>();
+		buildBlocks(floatBlocks);
+	} else {
+		floatBlocks = BlockSet<float>();
+		buildBlocks(doubleBlocks);
+	}
+}
+
+template <class Real>
+void Trimesh::buildBlocks(BlockSet<Real>& set)
+{
+	auto start = std::chrono::steady_clock::now();
+	// Neighbours along the curve make compact blocks, and reorder() has
+	// usually put the faces in that order already.  Where the curve jumps,
+	// a block is closed early: one long block straddles every split.
+	std::vector<uint32_t> sorted = mortonOrder();
+	set.store.clear();
+	set.store.reserve(sorted.size());
+	std::size_t first = 0;
+	BoundingBox blockBox;
+	double faceSize = 0.0;
+	for (std::size_t k = 0; k < sorted.size(); k++) {
+		BoundingBox b = faceBounds(sorted[k]);
+		BoundingBox merged = blockBox;
+		merged.merge(b);
+		double size = std::max(faceSize, longestSide(b));
+		if (k > first && (k - first == (std::size_t)triangle_block::kWidth ||
+		                  longestSide(merged) > kBlockSpread * size)) {
+			set.store.emplace_back(this, sorted.data() + first, (int)(k - first));
+			first = k;
+			merged = b;
+			size = longestSide(b);
+		}
+		blockBox = merged;
+		faceSize = size;
+	}
+	if (first < sorted.size())
+		set.store.emplace_back(this, sorted.data() + first, (int)(sorted.size() - first));
+	set.store.shrink_to_fit();
+	set.blocks.clear();
+	for (auto& block : set.store)
+		set.blocks.push_back(&block);
+	set.accel = makeCachedAccelerator(set.blocks, [this, &set](accel_cache::Hasher& h) {
+		// the faces' bounds only depend on the vertices and on which
+		// faces survived the degeneracy check, and on the precision
+		// the blocks round them to
+		h.add<int32_t>(sizeof(Real));
+		h.add(vertices);
+		for (auto block : set.blocks)
+			for (int f = 0; f < block->size(); f++)
+				for (int k = 0; k < 3; k++)
+					h.add(faces[block->face(f)][k]);
+	});
+	if (accel_report::enabled())
+	{
+		std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+		accel_report::add("trimesh", set.blocks.size(), *set.accel, seconds.count());
+	}
+}
+
+template <class Real>
+void Trimesh::addBlockStats(const BlockSet<Real>& set, AccelStats& stats)
+{
+	if (!set.accel)
+		return;
+	stats += set.accel->stats();
+	stats.bytes += set.store.capacity() * sizeof(TriangleBlock<Real>) +
+	               set.blocks.capacity() * sizeof(TriangleBlock<Real>*);
+}
+
+void Trimesh::addAccelStats(AccelStats& stats) const
+{
+	if (floatGeometry)
+		addBlockStats(floatBlocks, stats);
+	else
+		addBlockStats(doubleBlocks, stats);
+	stats.faces += faces.size();
+	stats.meshBytes += faces.capacity() * sizeof(TrimeshFace) +
+	                   vertices.capacity() * sizeof(glm::dvec3) +
+	                   normals.capacity() * sizeof(glm::dvec3) +
+	                   materials.capacity() * sizeof(Material*);
+}
+
 // Check to make sure that if we have per-vertex materials or normals
 // they are the right number.
 const char* Trimesh::doubleCheck()
@@ -70,16 +278,25 @@ const char* Trimesh::doubleCheck()
 
 bool Trimesh::intersectLocal(ray& r, isect& i) const
 {
+	bool have_one = floatGeometry ? intersectBlocks(floatBlocks, r, i)
+	                              : intersectBlocks(doubleBlocks, r, i);
+	if (!have_one)
+		i.setT(1000.0);
+	return have_one;
+}
 
+template <class Real>
+bool Trimesh::intersectBlocks(const BlockSet<Real>& set, ray& r, isect& i) const
+{
 	bool have_one = false;
 	if(traceUI->kdSwitch())
 	{
-		kdtree->intersect(r, i, have_one);
+		set.accel->intersect(r, i, have_one);
 	}
 	else {
-		for (auto face : faces) {
+		for (const auto& block : set.store) {
 			isect cur;
-			if (face->intersectLocal(r, cur)) {
+			if (block.intersect(r, cur)) {
 				if (!have_one || (cur.getT() < i.getT())) {
 					i = cur;
 					have_one = true;
@@ -87,81 +304,189 @@ bool Trimesh::intersectLocal(ray& r, isect& i) const
 			}
 		}
 	}
-	if (!have_one)
-		i.setT(1000.0);
 	return have_one;
 }
 
-bool TrimeshFace::intersect(ray& r, isect& i) const
+bool Trimesh::occludedLocal(ray& r) const
 {
-	return intersectLocal(r, i);
+	return floatGeometry ? occludedBlocks(floatBlocks, r)
+	                     : occludedBlocks(doubleBlocks, r);
 }
 
-// Intersect ray r with the triangle abc.  If it hits returns true,
-// and put the parameter in t and the barycentric coordinates of the
-// intersection in u (alpha) and v (beta).
-bool TrimeshFace::intersectLocal(ray& r, isect& i) const
+template <class Real>
+bool Trimesh::occludedBlocks(const BlockSet<Real>& set, ray& r) const
 {
-n
+	if (traceUI->kdSwitch())
+		return set.accel->occluded(r);
+	for (const auto& block : set.store)
+		if (block.occluded(r))
+			return true;
+	return false;
+}
 
-	// references to vertices
-    const auto& a = this->parent->vertices[ids[0]];
-    const auto& b = this->parent->vertices[ids[1]];
-    const auto& c = this->parent->vertices[ids[2]];
+bool TrimeshInstance::intersectLocal(ray& r, isect& i) const
+{
+	if (!mesh->intersectLocal(r, i))
+		return false;
+	// completed with this placement's transform, and its material unless
+	// the mesh has per vertex materials, which still win as they do for
+	// the mesh itself
+	i.setObject(this);
+	return true;
+}
+
+void TrimeshInstance::completeHitLocal(isect& i) const
+{
+	mesh->completeHitLocal(i);
+}
+
+bool TrimeshInstance::occludedLocal(ray& r) const
+{
+	return mesh->occludedLocal(r);
+}
 
-    // Check if ray is parallel 
-    if(abs(glm::dot(normal, r.getDirection())) < RAY_EPSILON)
-    	return false;
+bool TrimeshInstance::isOpaque() const
+{
+	if (ownMaterial && mesh->materials.empty())
+		return !getMaterial().Trans();
+	return mesh->isOpaque();
+}
 
-    double time_of_intersect = glm::dot(normal, (b - r.getPosition())) / glm::dot(normal, r.getDirection());
+// Watertight test of Woop, Benthin and Wald: the corners are moved into a
+// frame where the ray starts at the origin and runs along z, and the hit
+// is decided by the signs of the 2D edge functions there.  A face sharing
+// an edge computes the same edge function with the opposite sign, so a ray
+// through the edge hits at least one of them, and hits on the edge itself
+// count.  Both sides of the face are hit.
+bool Trimesh::hitFace(uint32_t f, const ray& r, double& time_of_intersect,
+                      double& m1, double& m2, double& m3) const
+{
+	const int* ids = faces[f].ids;
+	const int kx = r.getShearAxis(0);
+	const int ky = r.getShearAxis(1);
+	const int kz = r.getShearAxis(2);
+	const glm::dvec3& S = r.getShear();
+	const glm::dvec3 org = r.getPosition();
 
-    // object is behind us
-    if(time_of_intersect < RAY_EPSILON)
-    	return false;
+	const glm::dvec3 A = vertices[ids[0]] - org;
+	const glm::dvec3 B = vertices[ids[1]] - org;
+	const glm::dvec3 C = vertices[ids[2]] - org;
+	const double Ax = A[kx] - S[0] * A[kz];
+	const double Ay = A[ky] - S[1] * A[kz];
+	const double Bx = B[kx] - S[0] * B[kz];
+	const double By = B[ky] - S[1] * B[kz];
+	const double Cx = C[kx] - S[0] * C[kz];
+	const double Cy = C[ky] - S[1] * C[kz];
 
-    // point on plane of triangle
-    auto P = r.getPosition() + r.getDirection() * time_of_intersect;
-    // get bary coords
-    auto m2 = glm::dot(glm::cross((c - a), (P - a)), normal)/(glm::dot(glm::cross((c - a), (b - a)), normal));
-    auto m3 = glm::dot(glm::cross((b - a), (P - a)), normal)/(glm::dot(glm::cross((b - a), (c - a)), normal));
-    auto m1 = (1.0 - m2 - m3);
+	// scaled barycentrics of a, b and c
+	const double U = Cx * By - Cy * Bx;
+	const double V = Ax * Cy - Ay * Cx;
+	const double W = Bx * Ay - By * Ax;
+	if ((U < 0.0 || V < 0.0 || W < 0.0) && (U > 0.0 || V > 0.0 || W > 0.0))
+		return false;
+	const double det = U + V + W;
+	if (det == 0.0)
+		return false;
 
-    // verify intersect using bary coords
-    bool invalid_intersect =   (m1 < RAY_EPSILON || m1 > 1) 
-    						|| (m2 < RAY_EPSILON || m2 > 1) 
-    						|| (m3 < RAY_EPSILON || m3 > 1) 
-    						|| ((m2 + m3) < RAY_EPSILON || (m2 + m3) > 1);
+	// scaled distance, compared before dividing
+	const double T = U * (S[2] * A[kz]) + V * (S[2] * B[kz]) + W * (S[2] * C[kz]);
+	const double sign = det < 0.0 ? -1.0 : 1.0;
+	if (T * sign <= RAY_EPSILON * det * sign || T * sign > r.getTMax() * det * sign)
+		return false;
 
-    if(invalid_intersect) return false;
+	const double invDet = 1.0 / det;
+	time_of_intersect = T * invDet;
+	m1 = U * invDet;
+	m2 = V * invDet;
+	m3 = W * invDet;
+	return true;
+}
 
-    // set intersect info
+void Trimesh::setHit(isect& i, uint32_t f, double time_of_intersect,
+                     double m1, double m2, double m3) const
+{
+	// only what is needed to pick the closest hit, completeHitLocal()
+	// does the rest
 	i.setObject(this);
-	i.setMaterial(this->getMaterial());
+	i.setPrimitive(f);
 	i.setT(time_of_intersect);
-	i.setN(normal);
 	i.setBary(m1, m2, m3);
+}
 
+void Trimesh::completeHitLocal(isect& i) const
+{
+	const TrimeshFace& face = faces[i.getPrimitive()];
+	const int* ids = face.ids;
+	glm::dvec3 bary = i.getBary();
+	double m1 = bary[0], m2 = bary[1], m3 = bary[2];
+	i.setN(face.normal);
 	i.setUVCoordinates(glm::dvec2(m2, m3));
 	// interpolate vertex normals
-    if (parent->vertNorms)
+    if (vertNorms)
     {
-        i.setN(((m1 * parent->normals[ids[0]]) +
-        	    (m2 * parent->normals[ids[1]]) +
-        	    (m3 * parent->normals[ids[2]])));
+        i.setN(((m1 * normals[ids[0]]) +
+        	    (m2 * normals[ids[1]]) +
+        	    (m3 * normals[ids[2]])));
         i.setN(glm::normalize(i.getN())); 
     }
     // interpolate vertex materials
-    if (!parent->materials.empty())
+    if (!materials.empty())
     {
         Material m;
-        m += (m1 * Material(*parent->materials[ids[0]]));
-        m += (m2 * Material(*parent->materials[ids[1]]));
-        m += (m3 * Material(*parent->materials[ids[2]]));
+        m += (m1 * Material(*materials[ids[0]]));
+        m += (m2 * Material(*materials[ids[1]]));
+        m += (m3 * Material(*materials[ids[2]]));
 
-        i.setMaterial(m);
+        i.setMaterial(*hit_materials::add(m));
     }
-    // Check if 
-    return true;
+}
+
+// Clips the triangle against the six planes of region, so that a kd-tree
+// cell only references the face if the face really passes through it.
+bool Trimesh::clipFace(uint32_t f, const BoundingBox& region, glm::dvec3& lo,
+                       glm::dvec3& hi) const
+{
+	// every plane adds at most one vertex to the polygon
+	glm::dvec3 poly[9], clipped[9];
+	int n = 3;
+	for (int k = 0; k < 3; k++)
+		poly[k] = vertices[faces[f].ids[k]];
+	glm::dvec3 rmin = region.getMin();
+	glm::dvec3 rmax = region.getMax();
+	for (int axis = 0; axis < 3; axis++) {
+		for (int side = 0; side < 2; side++) {
+			double plane = side ? rmax[axis] : rmin[axis];
+			auto inside = [&](const glm::dvec3& v) {
+				return side ? v[axis] <= plane : v[axis] >= plane;
+			};
+			int m = 0;
+			for (int k = 0; k < n; k++) {
+				const glm::dvec3& a = poly[k];
+				const glm::dvec3& b = poly[(k + 1) % n];
+				if (inside(a))
+					clipped[m++] = a;
+				if (inside(a) != inside(b)) {
+					double t = (plane - a[axis]) / (b[axis] - a[axis]);
+					glm::dvec3 c = a + t * (b - a);
+					c[axis] = plane;
+					clipped[m++] = c;
+				}
+			}
+			if (m == 0)
+				return false;
+			n = m;
+			std::copy(clipped, clipped + n, poly);
+		}
+	}
+	glm::dvec3 cmin = poly[0], cmax = poly[0];
+	for (int k = 1; k < n; k++) {
+		cmin = glm::min(cmin, poly[k]);
+		cmax = glm::max(cmax, poly[k]);
+	}
+	// leave some room for rounding in the clipping
+	lo = glm::max(lo, cmin - glm::dvec3(RAY_EPSILON));
+	hi = glm::min(hi, cmax + glm::dvec3(RAY_EPSILON));
+	return true;
 }
 
 // Once all the verts and faces are loaded, per vertex normals can be
@@ -172,12 +497,10 @@ void Trimesh::generateNormals()
 	normals.resize(cnt);
 	std::vector<int> numFaces(cnt, 0);
 
-	for (auto face : faces) {
-		glm::dvec3 faceNormal = face->getNormal();
-
+	for (const auto& face : faces) {
 		for (int i = 0; i < 3; ++i) {
-			normals[(*face)[i]] += faceNormal;
-			++numFaces[(*face)[i]];
+			normals[face[i]] += face.normal;
+			++numFaces[face[i]];
 		}
 	}
 
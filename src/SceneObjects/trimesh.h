@@ -1,25 +1,39 @@
 #ifndef TRIMESH_H__
 #define TRIMESH_H__
 
+#include <cstdint>
 #include <list>
 #include <memory>
 #include <vector>
 
-#include "../scene/kdTree.h"
+#include "../scene/accelCache.h"
 #include "../scene/material.h"
 #include "../scene/ray.h"
 #include "../scene/scene.h"
+#include "triangleBlock.h"
 
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/vec3.hpp>
 
-class TrimeshFace;
+// One triangle of a mesh: its corners as indices into the mesh's
+// vertices (and per vertex normals and materials), and its normal.  The
+// mesh's material and transform apply to every face, so a face keeps
+// nothing else.
+struct TrimeshFace {
+	int ids[3];
+	glm::dvec3 normal;
+
+	int operator[](int i) const { return ids[i]; }
+};
 
 class Trimesh : public MaterialSceneObject {
-	friend class TrimeshFace;
+	friend class TrimeshInstance;
+	template <class Real>
+	friend class TriangleBlock;
+	friend void benchmarkTriangleTests(std::ostream &out);
 	typedef std::vector<glm::dvec3> Normals;
 	typedef std::vector<glm::dvec3> Vertices;
-	typedef std::vector<TrimeshFace *> Faces;
+	typedef std::vector<TrimeshFace> Faces;
 	typedef std::vector<Material *> Materials;
 
 	Vertices vertices;
@@ -27,7 +41,47 @@ class Trimesh : public MaterialSceneObject {
 	Normals normals;
 	Materials materials;
 	BoundingBox localBounds;
-	std::unique_ptr<KdTree<TrimeshFace*>> kdtree;
+	// the faces in groups of neighbours, which the acceleration
+	// structure is built over
+	template <class Real>
+	struct BlockSet {
+		std::vector<TriangleBlock<Real>> store;
+		std::vector<TriangleBlock<Real> *> blocks;
+		std::unique_ptr<Accelerator<TriangleBlock<Real> *>> accel;
+	};
+	// only one of these is built, see buildKdTree()
+	BlockSet<double> doubleBlocks;
+	BlockSet<float> floatBlocks;
+	bool floatGeometry = false;
+	// no face lets light through, set up with the acceleration structure
+	bool opaque = false;
+
+	// Intersect ray r with face f.  If it hits returns true, and put the
+	// parameter in t and the barycentric coordinates of the intersection
+	// in m1, m2 and m3.
+	bool hitFace(uint32_t f, const ray &r, double &t, double &m1,
+	             double &m2, double &m3) const;
+	// records a hit on face f found by hitFace()
+	void setHit(isect &i, uint32_t f, double t, double m1, double m2,
+	            double m3) const;
+	// the normal, uv coordinates and interpolated material of the hit
+	void completeHitLocal(isect &i) const;
+	BoundingBox faceBounds(uint32_t f) const;
+	// Clips face f against region, for perfect kd-tree splits
+	bool clipFace(uint32_t f, const BoundingBox &region, glm::dvec3 &lo,
+	              glm::dvec3 &hi) const;
+	// the faces' indices sorted along a Morton curve through their
+	// centroids
+	std::vector<uint32_t> mortonOrder() const;
+	template <class Real>
+	void buildBlocks(BlockSet<Real> &set);
+	template <class Real>
+	bool intersectBlocks(const BlockSet<Real> &set, ray &r, isect &i) const;
+	template <class Real>
+	bool occludedBlocks(const BlockSet<Real> &set, ray &r) const;
+	template <class Real>
+	static void addBlockStats(const BlockSet<Real> &set, AccelStats &stats);
+
 public:
 	Trimesh(Scene *scene, Material *mat, TransformNode *transform)
 	        : MaterialSceneObject(scene, mat),
@@ -41,6 +95,8 @@ public:
 	bool vertNorms;
 
 	bool intersectLocal(ray &r, isect &i) const;
+	bool occludedLocal(ray &r) const;
+	bool isOpaque() const { return opaque; }
 
 	~Trimesh();
 
@@ -51,16 +107,15 @@ public:
 	bool addFace(int a, int b, int c);
 
 	const char *doubleCheck();
+	// Sorts the faces along a Morton curve through their centroids and
+	// renumbers the vertices in the order the faces first use them, so the
+	// faces of one leaf and their vertices lie close together in memory.
+	// Call once all faces are added.
+	void reorder();
 	virtual bool isTrimesh() const { return true; }
 
-	virtual void buildKdTree()
-	{
-		// segfaults here for trimesh2
-		kdtree = std::make_unique<KdTree<TrimeshFace*>>(this->faces, 0);
-		// std::cout << faces.size()<<std::endl;
-		// std::cout << kdtree->countLeaf()<<' ' << kdtree->maxDepth()<<std::endl;
-
-	}
+	virtual void buildKdTree();
+	virtual void addAccelStats(AccelStats& stats) const;
 	void generateNormals();
 
 	bool hasBoundingBoxCapability() const { return true; }
@@ -91,73 +146,34 @@ protected:
 	mutable int displayListWithoutMaterials;
 };
 
-class TrimeshFace : public MaterialSceneObject {
-	Trimesh *parent;
-	int ids[3];
-	glm::dvec3 normal;
-	double dist;
+// Another placement of a Trimesh.  The vertices, faces and acceleration
+// structure all belong to the mesh, the instance only adds its own transform
+// and, optionally, a material that replaces the mesh's.
+class TrimeshInstance : public MaterialSceneObject {
+	const Trimesh *mesh;
+	bool ownMaterial;
 
 public:
-	TrimeshFace(Scene *scene, Material *mat, Trimesh *parent, int a, int b,
-	            int c)
-	        : MaterialSceneObject(scene, mat)
+	// mat may be null to keep the mesh's materials
+	TrimeshInstance(Scene *scene, Material *mat, const Trimesh *mesh)
+	        : MaterialSceneObject(scene, mat ? mat
+	                                         : new Material(mesh->getMaterial())),
+	          mesh(mesh), ownMaterial(mat != nullptr)
 	{
-		this->parent = parent;
-		ids[0]       = a;
-		ids[1]       = b;
-		ids[2]       = c;
-
-		// Compute the face normal here, not on the fly
-		glm::dvec3 a_coords = parent->vertices[a];
-		glm::dvec3 b_coords = parent->vertices[b];
-		glm::dvec3 c_coords = parent->vertices[c];
-
-		glm::dvec3 vab = (b_coords - a_coords);
-		glm::dvec3 vac = (c_coords - a_coords);
-		glm::dvec3 vcb = (b_coords - c_coords);
-
-		if (glm::length(vab) == 0.0 || glm::length(vac) == 0.0 ||
-		    glm::length(vcb) == 0.0)
-			degen = true;
-		else {
-			degen  = false;
-			normal = glm::cross(b_coords - a_coords,
-			                    c_coords - a_coords);
-			normal = glm::normalize(normal);
-			dist   = glm::dot(normal, a_coords);
-		}
-		localbounds = ComputeLocalBoundingBox();
-		bounds      = localbounds;
 	}
 
-	BoundingBox localbounds;
-	bool degen;
-
-	int operator[](int i) const { return ids[i]; }
-
-	glm::dvec3 getNormal() { return normal; }
-
-	bool intersect(ray &r, isect &i) const;
 	bool intersectLocal(ray &r, isect &i) const;
+	bool occludedLocal(ray &r) const;
+	void completeHitLocal(isect &i) const;
+	bool isOpaque() const;
 
 	bool hasBoundingBoxCapability() const { return true; }
 
-	BoundingBox ComputeLocalBoundingBox()
-	{
-		BoundingBox localbounds;
-		localbounds.setMax(glm::max(parent->vertices[ids[0]],
-		                            parent->vertices[ids[1]]));
-		localbounds.setMin(glm::min(parent->vertices[ids[0]],
-		                            parent->vertices[ids[1]]));
-
-		localbounds.setMax(glm::max(parent->vertices[ids[2]],
-		                            localbounds.getMax()));
-		localbounds.setMin(glm::min(parent->vertices[ids[2]],
-		                            localbounds.getMin()));
-		return localbounds;
-	}
-	// double getTrimeshArea(glm::dvec3&, glm::dvec3&, glm::dvec3&) const;
-	const BoundingBox &getBoundingBox() const { return localbounds; }
+	BoundingBox ComputeLocalBoundingBox() { return mesh->localBounds; }
+
+protected:
+	void glDrawLocal(int quality, bool actualMaterials,
+	                 bool actualTextures) const;
 };
 
 #endif // TRIMESH_H__
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+// Counts the allocations made through operator new, which allocCounter.cpp
+// replaces for the whole program, so -b can show that tracing does not
+// allocate.  Only built with the RAY_COUNT_ALLOCS CMake option; otherwise
+// nothing is counted and available() is false.
+namespace alloc_counter {
+#ifdef RAY_COUNT_ALLOCS
+inline bool available() { return true; }
+std::size_t count();
+#else
+inline bool available() { return false; }
+inline std::size_t count() { return 0; }
+#endif
+}
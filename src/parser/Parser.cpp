@@ -53,6 +53,7 @@ Scene* Parser::parseScene()
       case CYLINDER:
       case CONE:
       case TRIMESH:
+      case INSTANCE:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -165,6 +166,7 @@ void Parser::parseTransformableElement( Scene* scene, TransformNode* transform,
       case CYLINDER:
       case CONE:
       case TRIMESH:
+      case INSTANCE:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -195,6 +197,7 @@ void Parser::parseGroup(Scene* scene, TransformNode* transform, const Material&
       case CYLINDER:
       case CONE:
       case TRIMESH:
+      case INSTANCE:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -240,6 +243,9 @@ void Parser::parseGeometry(Scene* scene, TransformNode* transform, const Materia
     case TRIMESH:
       parseTrimesh(scene, transform, mat);
       return;
+    case INSTANCE:
+      parseInstance(scene, transform, mat);
+      return;
     case TRANSLATE:
       parseTranslate(scene, transform, mat);
       return;
@@ -555,7 +561,10 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   _tokenizer.Read( LBRACE );
 
   bool generateNormals( false );
+  // only defined for instances, not placed itself
+  bool prototype( false );
   list<glm::dvec3> faces;
+  string name;
 
   const char* error;
   for( ;; )
@@ -575,9 +584,13 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case NAME:
-         parseIdentExpression();
+         name = parseIdentExpression();
          break;
 
+      case PROTOTYPE:
+        prototype = parseBooleanExpression();
+        break;
+
       case MATERIALS:
         _tokenizer.Read( MATERIALS );
         _tokenizer.Read( EQUALS );
@@ -684,7 +697,21 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         if ((error = tmesh->doubleCheck()))
           throw ParserException(error);
 
-        scene->add( tmesh );
+        if( traceUI->meshReorderSwitch() )
+          tmesh->reorder();
+
+        if( !name.empty() && meshes.find( name ) != meshes.end() )
+          throw ParserException( "Redefinition of trimesh '" + name + "'." );
+        if( prototype )
+        {
+          if( name.empty() )
+            throw ParserException( "Prototype trimesh needs a name." );
+          scene->addPrototype( tmesh );
+        }
+        else
+          scene->add( tmesh );
+        if( !name.empty() )
+          meshes[name] = tmesh;
         return;
       }
 
@@ -694,6 +721,52 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   }
 }
 
+// Places another copy of a named trimesh, sharing its faces and
+// acceleration structure:
+//   instance { name = "dragon"; material = { ... }; }
+// A trimesh with "prototype = true;" is only defined, to be placed by
+// instances alone.
+void Parser::parseInstance(Scene* scene, TransformNode* transform, const Material& mat)
+{
+  Material* newMat = 0;
+  string name;
+
+  _tokenizer.Read( INSTANCE );
+  _tokenizer.Read( LBRACE );
+
+  for( ;; )
+  {
+    const Token* t = _tokenizer.Peek();
+
+    switch( t->kind() )
+    {
+      case MATERIAL:
+        delete newMat;
+        newMat = parseMaterialExpression( scene, mat );
+        break;
+      case NAME:
+        name = parseIdentExpression();
+        break;
+      case RBRACE:
+      {
+        _tokenizer.Read( RBRACE );
+        auto mesh = meshes.find( name );
+        if( mesh == meshes.end() )
+        {
+          delete newMat;
+          throw ParserException( "Instance of unknown trimesh '" + name + "'" );
+        }
+        TrimeshInstance* instance = new TrimeshInstance( scene, newMat, mesh->second );
+        instance->setTransform( transform );
+        scene->add( instance );
+        return;
+      }
+      default:
+        throw SyntaxErrorException( "Expected: instance attributes", _tokenizer );
+    }
+  }
+}
+
 void Parser::parseFaces( list< glm::dvec3 >& faces )
 {
   list< double > points = parseScalarList();
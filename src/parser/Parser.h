@@ -71,6 +71,7 @@ private:
     void      parseCylinder(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseCone(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseTrimesh(Scene* scene, TransformNode* transform, const Material& mat);
+    void      parseInstance(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseFaces( std::list< glm::dvec3 >& faces );
 
     // Parse transforms
@@ -105,6 +106,8 @@ private:
   private:
     Tokenizer& _tokenizer;
     mmap materials;
+    // named trimeshes, for instancing
+    std::map<string, Trimesh*> meshes;
     std::string _basePath;
 };
 
@@ -56,6 +56,7 @@ string getNameForToken( const SYMBOL kind )
     tokenNames[ CYLINDER ]          = "cylinder";
     tokenNames[ CONE ]              = "cone";
     tokenNames[ TRIMESH ]           = "trimesh";
+    tokenNames[ INSTANCE ]          = "instance";
     tokenNames[ POSITION ]          = "position";
     tokenNames[ VIEWDIR ]           = "viewdir";
     tokenNames[ UPDIR ]             = "updir";
@@ -72,6 +73,7 @@ string getNameForToken( const SYMBOL kind )
     tokenNames[ NORMALS ]           = "normals";
     tokenNames[ MATERIALS ]         = "materials";
     tokenNames[ FACES ]             = "faces";
+    tokenNames[ PROTOTYPE ]         = "prototype";
     tokenNames[ TRANSLATE ]         = "translate";
     tokenNames[ SCALE ]             = "scale";
     tokenNames[ ROTATE ]            = "rotate";
@@ -137,6 +139,7 @@ SYMBOL lookupReservedWord(const string& ident) {
     reservedWords["gennormals"] = GENNORMALS;
     reservedWords["height"] = HEIGHT;
     reservedWords["index"] = INDEX;
+    reservedWords["instance"] = INSTANCE;
     reservedWords["linear_attenuation_coeff"] = LINEAR_ATTENUATION_COEFF;
     reservedWords["material"] = MATERIAL;
     reservedWords["materials"] = MATERIALS;
@@ -147,6 +150,7 @@ SYMBOL lookupReservedWord(const string& ident) {
     reservedWords["points"] = POLYPOINTS;
     reservedWords["polymesh"] = TRIMESH;
     reservedWords["position"] = POSITION;
+    reservedWords["prototype"] = PROTOTYPE;
     reservedWords["quadratic_attenuation_coeff"] = QUADRATIC_ATTENUATION_COEFF;
     reservedWords["quaternian"] = QUATERNIAN;
     reservedWords["reflective"] = REFLECTIVE;
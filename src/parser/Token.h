@@ -56,6 +56,7 @@ enum SYMBOL {
   CYLINDER,
   CONE,
   TRIMESH,  
+  INSTANCE,				// placement of a named trimesh
 
   POSITION, VIEWDIR,		// keywords affecting primitives
   UPDIR, ASPECTRATIO,
@@ -70,7 +71,7 @@ enum SYMBOL {
 
   POLYPOINTS, NORMALS,			// keywords affecting polygons
   MATERIALS, FACES,
-  GENNORMALS,
+  GENNORMALS, PROTOTYPE,
 
   TRANSLATE, SCALE,			// Transforms
   ROTATE, TRANSFORM,
@@ -0,0 +1,170 @@
+#include "accelCache.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#if defined(_WIN32)
+#include <direct.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace accel_cache {
+namespace {
+// bump whenever the layout of a structure or of the file changes
+const uint32_t kVersion = 3;
+const char kMagic[8] = {'R', 'A', 'Y', 'A', 'C', 'C', 'E', 'L'};
+
+struct Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t pointerSize; // files are not shared between 32 and 64 bit builds
+	uint64_t key;
+	uint64_t size; // of the payload following the header
+};
+
+std::string path(uint64_t key)
+{
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx.accel", (unsigned long long)key);
+	return traceUI->getAccelCache() + "/" + name;
+}
+
+// true if the file in data was written for key and is complete
+bool check(const char* data, std::size_t size, uint64_t key)
+{
+	Header header;
+	if (size < sizeof(header))
+		return false;
+	std::memcpy(&header, data, sizeof(header));
+	return std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+	       header.version == kVersion &&
+	       header.pointerSize == sizeof(void*) &&
+	       header.key == key &&
+	       header.size == size - sizeof(header);
+}
+}
+
+void Hasher::add(const void* data, std::size_t size)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (std::size_t k = 0; k < size; k++)
+	{
+		hash ^= bytes[k];
+		hash *= 1099511628211ull;
+	}
+}
+
+uint64_t key(uint64_t contents, std::size_t count)
+{
+	Hasher h;
+	h.add(contents);
+	h.add<uint64_t>(count);
+	h.add<int32_t>(traceUI->getAccelerator());
+	h.add<int32_t>(traceUI->getMaxDepth());
+	h.add<int32_t>(traceUI->getLeafSize());
+	h.add<int32_t>(traceUI->kdSahSwitch());
+	h.add<int32_t>(traceUI->kdPerfectSplitsSwitch());
+	h.add<int32_t>(traceUI->kdAutotuneSwitch());
+	h.add<int32_t>(traceUI->kdLazySwitch());
+	return h.value();
+}
+
+Entry::Entry(uint64_t key)
+{
+	std::string file = path(key);
+#if defined(_WIN32)
+	std::ifstream in(file, std::ios::binary);
+	if (!in)
+		return;
+	buffer.assign(std::istreambuf_iterator<char>(in),
+	              std::istreambuf_iterator<char>());
+	if (!check(buffer.data(), buffer.size(), key))
+		return;
+	payload = buffer.data() + sizeof(Header);
+	end = buffer.data() + buffer.size();
+#else
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED)
+		{
+			mapping = p;
+			mappedSize = st.st_size;
+		}
+	}
+	close(fd);
+	if (!mapping)
+		return;
+	const char* data = static_cast<const char*>(mapping);
+	if (!check(data, mappedSize, key))
+		return;
+	payload = data + sizeof(Header);
+	end = data + mappedSize;
+#endif
+}
+
+Entry::~Entry()
+{
+#if !defined(_WIN32)
+	if (mapping)
+		munmap(mapping, mappedSize);
+#endif
+}
+
+bool store(uint64_t key, const std::string& payload)
+{
+	const std::string& dir = traceUI->getAccelCache();
+#if defined(_WIN32)
+	_mkdir(dir.c_str());
+	int pid = _getpid();
+#else
+	mkdir(dir.c_str(), 0777);
+	int pid = getpid();
+#endif
+	Header header;
+	std::memcpy(header.magic, kMagic, sizeof(kMagic));
+	header.version = kVersion;
+	header.pointerSize = sizeof(void*);
+	header.key = key;
+	header.size = payload.size();
+
+	// written under a name of its own and renamed when complete, so other
+	// threads and processes never see half a file
+	std::string file = path(key);
+	std::ostringstream tmp;
+	tmp << file << "." << pid << "." << std::this_thread::get_id() << ".tmp";
+	{
+		std::ofstream out(tmp.str(), std::ios::binary);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(payload.data(), payload.size());
+		if (!out)
+		{
+			std::cerr << "Couldn't write acceleration structure cache "
+			          << tmp.str() << std::endl;
+			std::remove(tmp.str().c_str());
+			return false;
+		}
+	}
+#if defined(_WIN32)
+	std::remove(file.c_str()); // rename does not replace files here
+#endif
+	if (std::rename(tmp.str().c_str(), file.c_str()) != 0)
+	{
+		std::remove(tmp.str().c_str());
+		return false;
+	}
+	return true;
+}
+}
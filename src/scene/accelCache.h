@@ -0,0 +1,101 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "accelFactory.h"
+#include "../ui/TraceUI.h"
+extern TraceUI* traceUI;
+
+// On-disk cache of built acceleration structures, so reloading a scene whose
+// meshes did not change skips their builds.  It is off unless a directory is
+// set with -C (or "accel_cache" in the JSON settings).  Every structure gets
+// one file, named after a hash of the objects it was built over and of every
+// setting the build depends on, so an edited mesh or a different setting
+// simply misses.
+namespace accel_cache {
+// 64 bit FNV-1a
+class Hasher
+{
+public:
+	void add(const void* data, std::size_t size);
+	template <class V>
+	void add(const V& value)
+	{
+		add(&value, sizeof(V));
+	}
+	template <class V>
+	void add(const std::vector<V>& values)
+	{
+		add<uint64_t>(values.size());
+		add(values.data(), values.size() * sizeof(V));
+	}
+	uint64_t value() const { return hash; }
+
+private:
+	uint64_t hash = 14695981039346656037ull;
+};
+
+// Cache key of a structure over count objects whose contents hash to
+// contents, under the current settings.
+uint64_t key(uint64_t contents, std::size_t count);
+
+// A cache file, mapped into memory while this is alive.  empty() if there is
+// no file for the key or it does not look like one written for it.
+class Entry
+{
+public:
+	explicit Entry(uint64_t key);
+	~Entry();
+	Entry(const Entry&) = delete;
+	Entry& operator=(const Entry&) = delete;
+
+	bool empty() const { return payload == nullptr; }
+	AccelReader reader() const { return AccelReader(payload, end); }
+
+private:
+	void* mapping = nullptr;
+	std::size_t mappedSize = 0;
+	// used where files cannot be mapped
+	std::vector<char> buffer;
+	const char* payload = nullptr;
+	const char* end = nullptr;
+};
+
+// Writes the cache file for key.  Returns false, after saying why, if it
+// could not be written.
+bool store(uint64_t key, const std::string& payload);
+}
+
+// Like makeAccelerator(), but goes through the cache when one is set up.
+// hashContents(Hasher&) has to add everything the objects' bounds depend
+// on; it is only called when the cache is in use.
+template <class T, class Contents>
+std::unique_ptr<Accelerator<T>> makeCachedAccelerator(std::vector<T>& objects,
+                                                      Contents hashContents)
+{
+	if (traceUI->getAccelCache().empty())
+		return makeAccelerator(objects);
+
+	accel_cache::Hasher contents;
+	hashContents(contents);
+	uint64_t key = accel_cache::key(contents.value(), objects.size());
+	{
+		accel_cache::Entry entry(key);
+		if (!entry.empty())
+		{
+			AccelReader in = entry.reader();
+			auto accel = loadAccelerator(objects, in);
+			if (accel)
+				return accel;
+		}
+	}
+	auto accel = makeAccelerator(objects);
+	AccelWriter out;
+	accel->save(out);
+	// a lazy tree has nothing built yet that could be stored
+	if (!out.data.empty())
+		accel_cache::store(key, out.data);
+	return accel;
+}
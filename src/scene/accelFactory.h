@@ -0,0 +1,119 @@
+#pragma once
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "accelerator.h"
+#include "bvh.h"
+#include "grid.h"
+#include "kdTree.h"
+#include "lazyKdTree.h"
+#include "wideBvh.h"
+#include "../ui/TraceUI.h"
+extern TraceUI* traceUI;
+
+// "auto" picks the grid for many objects of about the same size spread
+// evenly through their bounds, which it handles best, and the kd-tree for
+// everything else.  Sizes count as the same when the diagonals of the
+// objects' bounds vary by at most kMaxSpread of their mean.  The spread
+// counts as even when at least kMinOccupancy of the grid's cells would
+// hold an object (see uniform_grid::occupancy()); a mesh's surface, or a
+// cluster in a large empty box, leaves most of them empty, and the grid's
+// capped resolution puts too many objects in the few cells that are not.
+namespace accel_auto {
+const std::size_t kMinObjects = 16;
+const double kMaxSpread = 0.5;
+const double kMinOccupancy = 0.3;
+}
+
+// The structure to build over objects with these bounds: the one selected
+// in the UI, or the one picked for them if that is "auto".
+inline AccelType chooseAccelerator(const std::vector<BoundingBox>& bounds)
+{
+	using namespace accel_auto;
+	AccelType type = traceUI->getAccelerator();
+	if (type != ACCEL_AUTO)
+		return type;
+	if (bounds.size() < kMinObjects)
+		return ACCEL_KDTREE;
+	double sum = 0.0, sumSquares = 0.0;
+	for (const auto& b : bounds)
+	{
+		double d = glm::length(b.getMax() - b.getMin());
+		sum += d;
+		sumSquares += d * d;
+	}
+	double mean = sum / bounds.size();
+	double variance = std::max(0.0, sumSquares / bounds.size() - mean * mean);
+	if (mean > 0.0 && std::sqrt(variance) <= kMaxSpread * mean &&
+	    uniform_grid::occupancy(bounds) >= kMinOccupancy)
+		return ACCEL_GRID;
+	return ACCEL_KDTREE;
+}
+
+// Builds the acceleration structure selected in the UI over objects, whose
+// bounds are given in the same order (see objectBounds()).
+template <class T>
+std::unique_ptr<Accelerator<T>> makeAccelerator(std::vector<T>& objects,
+                                                const std::vector<BoundingBox>& bounds)
+{
+	switch (chooseAccelerator(bounds))
+	{
+	case ACCEL_GRID:
+		return std::make_unique<Grid<T>>(objects, bounds);
+	case ACCEL_BVH:
+		return std::make_unique<Bvh<T>>(objects, bounds);
+	case ACCEL_BVH4:
+		return std::make_unique<WideBvh<T>>(objects, bounds);
+	case ACCEL_KDTREE:
+	default:
+		if (traceUI->kdLazySwitch())
+			return std::make_unique<LazyKdTree<T>>(objects, bounds);
+		// the SAH build picks its leaves by itself
+		if (traceUI->kdAutotuneSwitch() && !traceUI->kdSahSwitch() &&
+		    !traceUI->kdPerfectSplitsSwitch())
+			return tunedKdTree(objects, bounds);
+		return std::make_unique<KdTree<T>>(objects, bounds, 0,
+		                                   traceUI->getMaxDepth(),
+		                                   traceUI->getLeafSize());
+	}
+}
+
+// Builds the acceleration structure selected in the UI over objects.
+template <class T>
+std::unique_ptr<Accelerator<T>> makeAccelerator(std::vector<T>& objects)
+{
+	return makeAccelerator(objects, objectBounds(objects));
+}
+
+// Reads back a structure of the type selected in the UI, as saved for the
+// same objects.  Returns null if the data does not fit them, or if a lazy
+// kd-tree is selected, which is always built afresh.
+template <class T>
+std::unique_ptr<Accelerator<T>> loadAccelerator(std::vector<T>& objects,
+                                                AccelReader& in)
+{
+	std::unique_ptr<Accelerator<T>> accel;
+	// the same choice as when it was saved
+	switch (chooseAccelerator(objectBounds(objects)))
+	{
+	case ACCEL_GRID:
+		accel = std::make_unique<Grid<T>>(objects, in);
+		break;
+	case ACCEL_BVH:
+		accel = std::make_unique<Bvh<T>>(objects, in);
+		break;
+	case ACCEL_BVH4:
+		accel = std::make_unique<WideBvh<T>>(objects, in);
+		break;
+	case ACCEL_KDTREE:
+	default:
+		// a full tree read back would not be lazy any more
+		if (traceUI->kdLazySwitch())
+			return nullptr;
+		accel = std::make_unique<KdTree<T>>(objects, in);
+		break;
+	}
+	if (!in.done())
+		accel.reset();
+	return accel;
+}
@@ -0,0 +1,119 @@
+#include "accelReport.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include "../ui/TraceUI.h"
+#include "../ui/json.hpp"
+extern TraceUI* traceUI;
+
+using Json = nlohmann::json;
+
+namespace accel_report {
+namespace {
+struct Entry
+{
+	std::string owner;
+	std::size_t objects;
+	AccelStats stats;
+	double sahCost;
+	double seconds;
+};
+
+// meshes build their structures in parallel
+std::mutex lock;
+std::vector<Entry> entries;
+
+Json toJson(std::size_t objects, const AccelStats& s)
+{
+	Json j;
+	j["objects"] = objects;
+	j["nodes"] = s.nodes;
+	j["leaves"] = s.leaves;
+	j["references"] = s.references;
+	j["duplicated_references"] =
+	        s.references > objects ? s.references - objects : 0;
+	j["bytes"] = s.bytes;
+	j["max_depth"] = s.maxDepth;
+	j["leaf_depths"] = s.leafDepths;
+	j["leaf_sizes"] = s.leafSizes;
+	return j;
+}
+}
+
+bool enabled()
+{
+	return !traceUI->getAccelReport().empty();
+}
+
+void add(const std::string& owner, std::size_t objects,
+         const AccelStats& stats, double sahCost, double seconds)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	entries.push_back({owner, objects, stats, sahCost, seconds});
+}
+
+void clear()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	entries.clear();
+}
+
+bool write(const std::string& file)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	// the order the meshes finish building in varies from run to run, so
+	// sort to make reports of the same scene comparable
+	std::stable_sort(entries.begin(), entries.end(),
+	                 [](const Entry& a, const Entry& b) {
+		if (a.owner != b.owner)
+			return a.owner < b.owner;
+		return a.objects > b.objects;
+	});
+
+	Json report;
+	report["accelerator"] = TraceUI::acceleratorName(traceUI->getAccelerator());
+	report["tree_depth"] = traceUI->getMaxDepth();
+	report["leaf_size"] = traceUI->getLeafSize();
+	report["kd_sah"] = traceUI->kdSahSwitch();
+	report["kd_perfect_splits"] = traceUI->kdPerfectSplitsSwitch();
+	report["kd_autotune"] = traceUI->kdAutotuneSwitch();
+	report["structures"] = Json::array();
+	AccelStats total;
+	std::size_t totalObjects = 0;
+	double totalSeconds = 0.0;
+	for (const auto& e : entries)
+	{
+		Json j = toJson(e.objects, e.stats);
+		j["owner"] = e.owner;
+		// what "auto" picked, if it was selected
+		j["accelerator"] = TraceUI::acceleratorName(e.stats.type);
+		if (e.stats.treeDepth > 0)
+		{
+			// the limits actually used, which differ from the settings
+			// above when tuned
+			j["tree_depth"] = e.stats.treeDepth;
+			j["leaf_size"] = e.stats.leafSize;
+		}
+		j["sah_cost"] = e.sahCost;
+		j["build_seconds"] = e.seconds;
+		report["structures"].push_back(j);
+		total += e.stats;
+		totalObjects += e.objects;
+		totalSeconds += e.seconds;
+	}
+	report["total"] = toJson(totalObjects, total);
+	report["total"]["build_seconds"] = totalSeconds;
+
+	std::ofstream out(file);
+	out << report.dump(2) << std::endl;
+	if (!out)
+	{
+		std::cerr << "Couldn't write acceleration structure report "
+		          << file << std::endl;
+		return false;
+	}
+	return true;
+}
+}
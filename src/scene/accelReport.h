@@ -0,0 +1,27 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include "accelerator.h"
+
+// Quality report on the acceleration structures built while loading a scene,
+// written as JSON with -R.  It is meant for tuning tree_depth and leaf_size
+// per scene and for catching builds that got worse.  Nothing is collected
+// unless a report file is set.
+namespace accel_report {
+bool enabled();
+// Adds a structure over objects objects.  owner says what it was built for,
+// seconds how long the build took (or reading it from the cache).
+void add(const std::string& owner, std::size_t objects,
+         const AccelStats& stats, double sahCost, double seconds);
+template <class T>
+void add(const std::string& owner, std::size_t objects,
+         const Accelerator<T>& accel, double seconds)
+{
+	add(owner, objects, accel.stats(), accel.sahCost(), seconds);
+}
+// forgets everything added so far
+void clear();
+// Writes everything added since the last clear() to file.  Returns false,
+// after saying why, if it could not be written.
+bool write(const std::string& file);
+}
@@ -0,0 +1,206 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include "bbox.h"
+#include "ray.h"
+#include "../ui/TraceUI.h"
+
+// Size and shape of one or more built acceleration structures, see
+// Accelerator::stats()
+struct AccelStats
+{
+	std::size_t nodes = 0;
+	std::size_t leaves = 0;
+	// object references stored in leaves, including duplicates
+	std::size_t references = 0;
+	// memory footprint
+	std::size_t bytes = 0;
+	// faces of the meshes the structures were built for, and the memory
+	// of those meshes' faces, vertices, normals and materials, which bytes
+	// leaves out
+	std::size_t faces = 0;
+	std::size_t meshBytes = 0;
+	// depth of the deepest leaf, the root being at depth 0
+	int maxDepth = 0;
+	// leafDepths[d] leaves at depth d, leafSizes[k] leaves holding k
+	// objects
+	std::vector<std::size_t> leafDepths;
+	std::vector<std::size_t> leafSizes;
+	// depth and leaf size limits the structure was built with, where it
+	// has them.  Not summed up.
+	int treeDepth = 0;
+	int leafSize = 0;
+	// the kind of structure, never ACCEL_AUTO.  Not summed up either.
+	AccelType type = ACCEL_KDTREE;
+
+	void addLeaf(int depth, std::size_t size)
+	{
+		maxDepth = std::max(maxDepth, depth);
+		count(leafDepths, depth, 1);
+		count(leafSizes, size, 1);
+		leaves++;
+	}
+
+	AccelStats& operator+=(const AccelStats& other)
+	{
+		nodes += other.nodes;
+		leaves += other.leaves;
+		references += other.references;
+		bytes += other.bytes;
+		faces += other.faces;
+		meshBytes += other.meshBytes;
+		maxDepth = std::max(maxDepth, other.maxDepth);
+		for (std::size_t k = 0; k < other.leafDepths.size(); k++)
+			count(leafDepths, k, other.leafDepths[k]);
+		for (std::size_t k = 0; k < other.leafSizes.size(); k++)
+			count(leafSizes, k, other.leafSizes[k]);
+		return *this;
+	}
+
+private:
+	static void count(std::vector<std::size_t>& histogram, std::size_t k,
+	                  std::size_t n)
+	{
+		if (histogram.size() <= k)
+			histogram.resize(k + 1, 0);
+		histogram[k] += n;
+	}
+};
+
+// Flat binary form of a built structure, as kept in the on-disk cache (see
+// accelCache.h).  Only plain data goes in; objects are written as their
+// index in the list the structure was built over.
+struct AccelWriter
+{
+	std::string data;
+
+	template <class V>
+	void write(const V& value)
+	{
+		data.append(reinterpret_cast<const char*>(&value), sizeof(V));
+	}
+	template <class V>
+	void write(const std::vector<V>& values)
+	{
+		write<uint64_t>(values.size());
+		data.append(reinterpret_cast<const char*>(values.data()),
+		            values.size() * sizeof(V));
+	}
+};
+
+// Reads back what an AccelWriter wrote.  Running past the end, or any
+// check a structure makes on what it read, clears ok instead of throwing,
+// so a damaged cache entry just means a rebuild.
+struct AccelReader
+{
+	const char* data;
+	const char* end;
+	bool ok = true;
+
+	AccelReader(const char* begin, const char* finish) :
+	   data(begin),
+	   end(finish) {}
+
+	template <class V>
+	void read(V& value)
+	{
+		if (!ok || std::size_t(end - data) < sizeof(V))
+		{
+			ok = false;
+			return;
+		}
+		std::memcpy(&value, data, sizeof(V));
+		data += sizeof(V);
+	}
+	template <class V>
+	void read(std::vector<V>& values)
+	{
+		uint64_t n = 0;
+		read(n);
+		if (!ok || n > std::size_t(end - data) / sizeof(V))
+		{
+			ok = false;
+			return;
+		}
+		values.resize(n);
+		std::memcpy(values.data(), data, n * sizeof(V));
+		data += n * sizeof(V);
+	}
+	// true if everything was read without error, down to the last byte
+	bool done() const { return ok && data == end; }
+};
+
+// Scalar type the structures over T keep their node bounds in.  Float
+// triangle blocks specialize it (see triangleBlock.h), so the nodes of
+// float meshes shrink along with their corners.  Rays and the slab tests
+// stay in double.
+template <class T>
+struct AccelScalar
+{
+	typedef double type;
+};
+
+// x as the nearest Real no greater than it (roundDown) or no less than it
+// (roundUp), so bounds kept in Real still contain what they bound.
+template <class Real>
+Real roundDown(double x)
+{
+	Real r = Real(x);
+	return double(r) > x ? std::nextafter(r, -std::numeric_limits<Real>::infinity()) : r;
+}
+
+template <class Real>
+Real roundUp(double x)
+{
+	Real r = Real(x);
+	return double(r) < x ? std::nextafter(r, std::numeric_limits<Real>::infinity()) : r;
+}
+
+// The objects' bounds, in order.  Builds read them from such a list rather
+// than from the objects, so a build can run on bounds copied earlier while
+// the objects move on (see Scene::updateTransforms()).
+template <class T>
+std::vector<BoundingBox> objectBounds(const std::vector<T>& objects)
+{
+	std::vector<BoundingBox> bounds;
+	bounds.reserve(objects.size());
+	for (const auto& obj : objects)
+		bounds.push_back(obj->getBoundingBox());
+	return bounds;
+}
+
+// Common interface of the acceleration structures.  T is a pointer-like
+// handle to an object with getBoundingBox(), intersect(ray&, isect&),
+// occluded(ray&) and clipBounds() (see Geometry), and the structure only
+// answers queries for the objects it was built over.
+template <class T>
+class Accelerator
+{
+public:
+	virtual ~Accelerator() {}
+
+	// Finds the closest hit along r.  If have_one is already set, i holds a
+	// hit found elsewhere and is only replaced by a closer one.
+	virtual bool intersect(ray& r, isect& i, bool& have_one) const = 0;
+	// True if any object reports r occluded (see Geometry::occluded()).
+	// Stops at the first one, in no particular order.
+	virtual bool occluded(ray& r) const = 0;
+	virtual AccelStats stats() const = 0;
+	// Updates the structure to the objects' current bounds without changing
+	// which objects it groups together.  Returns false if the structure
+	// cannot do that and has to be rebuilt instead.
+	virtual bool refit() { return false; }
+	// Expected cost of a query, in object intersections, by the surface
+	// area heuristic.  Refitting makes it grow as objects move away from
+	// the ones they were grouped with.
+	virtual double sahCost() const { return 0.0; }
+	// Appends the built structure to out.  The structures also have a
+	// constructor taking the objects and an AccelReader that reads it back.
+	virtual void save(AccelWriter& out) const = 0;
+};
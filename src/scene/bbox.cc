@@ -33,30 +33,24 @@ bool BoundingBox::intersects(const glm::dvec3& point) const
 bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 {
 	/*
- 	 * Kay/Kajiya algorithm.
+ 	 * Kay/Kajiya algorithm, with the slab planes ordered by the sign of
+	 * the direction so no swap (and no division) is needed.  A ray
+	 * parallel to a slab gets a huge inverse direction, which pushes both
+	 * plane distances to the same infinity when it starts outside it.
 	 */
 	glm::dvec3 R0 = r.getPosition();
-	glm::dvec3 Rd = r.getDirection();
+	const glm::dvec3& invD = r.getInverseDirection();
 	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough
 	                 // for us!
 	tMax = 1.0e308;
-	double ttemp;
 
 	for (int currentaxis = 0; currentaxis < 3; currentaxis++) {
-		double vd = Rd[currentaxis];
-		// if the ray is parallel to the face's plane (=0.0)
-		if (vd == 0.0)
-			continue;
-		double v1 = bmin[currentaxis] - R0[currentaxis];
-		double v2 = bmax[currentaxis] - R0[currentaxis];
+		int neg = r.getSign(currentaxis);
+		double nearPlane = neg ? bmax[currentaxis] : bmin[currentaxis];
+		double farPlane = neg ? bmin[currentaxis] : bmax[currentaxis];
 		// two slab intersections
-		double t1 = v1 / vd;
-		double t2 = v2 / vd;
-		if (t1 > t2) { // swap t1 & t2
-			ttemp = t1;
-			t1    = t2;
-			t2    = ttemp;
-		}
+		double t1 = (nearPlane - R0[currentaxis]) * invD[currentaxis];
+		double t2 = (farPlane - R0[currentaxis]) * invD[currentaxis];
 		if (t1 > tMin)
 			tMin = t1;
 		if (t2 < tMax)
@@ -66,6 +60,8 @@ bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 		if (tMax < RAY_EPSILON)
 			return false; // box is behind ray
 	}
+	if (tMin > r.getTMax())
+		return false; // box starts past the closest hit so far
 	return true; // it made it past all 3 axes.
 }
 
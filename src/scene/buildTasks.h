@@ -0,0 +1,48 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <future>
+#include "../ui/TraceUI.h"
+extern TraceUI* traceUI;
+
+// Runs independent parts of acceleration structure builds (whole meshes,
+// large subtrees) on extra threads.  All builds share one budget of
+// getThreads() - 1 extra threads, and work that finds the budget used up
+// simply runs on the calling thread, so the results never depend on how
+// many threads were available.
+namespace build_tasks {
+// subtrees over fewer objects are not worth a thread of their own
+const std::size_t kMinObjects = 4096;
+
+inline std::atomic<int>& running()
+{
+	static std::atomic<int> count(0);
+	return count;
+}
+
+// Starts f on another thread if the budget allows, otherwise runs it right
+// away.  Either way the returned future is ready once f is done.
+template <class F>
+std::future<void> spawn(F f)
+{
+	int limit = traceUI->getThreads() - 1;
+	int current = running().load();
+	while (current < limit)
+	{
+		if (running().compare_exchange_weak(current, current + 1))
+		{
+			return std::async(std::launch::async, [f]() mutable {
+				struct Release
+				{
+					~Release() { running()--; }
+				} release;
+				f();
+			});
+		}
+	}
+	f();
+	std::promise<void> done;
+	done.set_value();
+	return done.get_future();
+}
+}
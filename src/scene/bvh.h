@@ -0,0 +1,493 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include "accelerator.h"
+#include "bbox.h"
+#include "buildTasks.h"
+#include "ray.h"
+#include "../ui/TraceUI.h"
+extern TraceUI* traceUI;
+
+// Bounding volume hierarchy built with the binned surface area heuristic.
+// Unlike the kd-tree every object is referenced exactly once, so the memory
+// use is bounded by the object count and the build is a plain partition.
+namespace bvh_sah {
+const int kBins = 12;
+// cost of visiting a node relative to intersecting one object
+const double kTraversalCost = 0.125;
+// deeper nodes are split at the median, which keeps every tree (and so the
+// traversal stack) within kMaxDepth levels
+const int kMedianDepth = 32;
+const int kMaxDepth = 64;
+}
+
+template <class T>
+class Bvh : public Accelerator<T>
+{
+	// collapses the built tree
+	template <class U>
+	friend class WideBvh;
+private:
+	typedef typename AccelScalar<T>::type Real;
+	// per object bounds, looked up once before the build
+	struct BuildState
+	{
+		std::vector<glm::dvec3> primMin;
+		std::vector<glm::dvec3> primMax;
+		std::vector<glm::dvec3> centroid;
+	};
+
+	// 64 bytes per node, or 36 with float bounds, laid out depth first.
+	// The left child of an interior node directly follows it.
+	struct Node
+	{
+		Real bmin[3];
+		Real bmax[3];
+		uint32_t offset; // first entry in _primIndices, or the right child
+		uint32_t count;  // objects in a leaf, 0 for interior nodes
+		uint32_t axis;   // split axis of an interior node
+		bool isLeaf() const { return count > 0; }
+		glm::dvec3 lo() const { return glm::dvec3(bmin[0], bmin[1], bmin[2]); }
+		glm::dvec3 hi() const { return glm::dvec3(bmax[0], bmax[1], bmax[2]); }
+		void setBounds(const glm::dvec3& lo, const glm::dvec3& hi)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				bmin[k] = roundDown<Real>(lo[k]);
+				bmax[k] = roundUp<Real>(hi[k]);
+			}
+		}
+	};
+
+	std::vector<Node> _nodes;
+	// leaf contents, as indices into _prims
+	std::vector<uint32_t> _primIndices;
+	std::vector<T> _prims;
+
+	void build(const BuildState& state, std::vector<Node>& nodes,
+	           uint32_t begin, uint32_t end, int depth);
+	static double halfArea(const glm::dvec3& bmin, const glm::dvec3& bmax);
+	bool valid() const;
+	template <class Visit>
+	bool traverse(ray& r, Visit visit) const;
+public:
+	Bvh(std::vector<T>& objects);
+	Bvh(std::vector<T>& objects, const std::vector<BoundingBox>& bounds);
+	Bvh(std::vector<T>& objects, AccelReader& in);
+	bool intersect(ray& r, isect& i, bool& have_one) const override;
+	bool occluded(ray& r) const override;
+	AccelStats stats() const override;
+	bool refit() override;
+	double sahCost() const override;
+	void save(AccelWriter& out) const override;
+};
+
+template <class T>
+Bvh<T>::Bvh(std::vector<T>& objects) :
+   Bvh(objects, objectBounds(objects)) {}
+
+template <class T>
+Bvh<T>::Bvh(std::vector<T>& objects, const std::vector<BoundingBox>& bounds) :
+   _nodes(),
+   _primIndices(),
+   _prims(objects)
+{
+	BuildState state;
+	state.primMin.reserve(_prims.size());
+	state.primMax.reserve(_prims.size());
+	state.centroid.reserve(_prims.size());
+	_primIndices.reserve(_prims.size());
+	for (uint32_t k = 0; k < _prims.size(); k++)
+	{
+		const BoundingBox& b = bounds[k];
+		state.primMin.push_back(b.getMin());
+		state.primMax.push_back(b.getMax());
+		state.centroid.push_back(0.5 * (b.getMin() + b.getMax()));
+		_primIndices.push_back(k);
+	}
+	if (!_prims.empty())
+	{
+		// a binary tree over n leaves has fewer than 2n nodes
+		_nodes.reserve(2 * _prims.size());
+		build(state, _nodes, 0, _prims.size(), 0);
+		_nodes.shrink_to_fit();
+	}
+}
+
+template <class T>
+Bvh<T>::Bvh(std::vector<T>& objects, AccelReader& in) :
+   _nodes(),
+   _primIndices(),
+   _prims(objects)
+{
+	in.read(_nodes);
+	in.read(_primIndices);
+	if (!in.ok || !valid())
+	{
+		in.ok = false;
+		_nodes.clear();
+		_primIndices.clear();
+	}
+}
+
+template <class T>
+void Bvh<T>::save(AccelWriter& out) const
+{
+	out.write(_nodes);
+	out.write(_primIndices);
+}
+
+// Checks a tree read from the cache, see KdTree::valid()
+template <class T>
+bool Bvh<T>::valid() const
+{
+	std::vector<int> depth(_nodes.size(), 1);
+	for (uint32_t k = 0; k < _nodes.size(); k++)
+	{
+		const Node& node = _nodes[k];
+		if (depth[k] > bvh_sah::kMaxDepth)
+			return false;
+		if (node.isLeaf())
+		{
+			if (node.offset > _primIndices.size() ||
+			    node.count > _primIndices.size() - node.offset)
+				return false;
+			continue;
+		}
+		if (node.axis > 2 || node.offset <= k + 1 || node.offset >= _nodes.size())
+			return false;
+		depth[k + 1] = depth[node.offset] = depth[k] + 1;
+	}
+	for (uint32_t p : _primIndices)
+		if (p >= _prims.size())
+			return false;
+	return true;
+}
+
+template <class T>
+double Bvh<T>::halfArea(const glm::dvec3& bmin, const glm::dvec3& bmax)
+{
+	glm::dvec3 d = bmax - bmin;
+	return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+}
+
+// Emits the subtree over _primIndices[begin, end) into nodes, with indices
+// relative to the start of nodes.  Subtrees work on disjoint ranges of
+// _primIndices, so a large right child is built by a task of its own into a
+// separate array and appended after the left one.
+template <class T>
+void Bvh<T>::build(const BuildState& state, std::vector<Node>& nodes,
+                   uint32_t begin, uint32_t end, int depth)
+{
+	using namespace bvh_sah;
+	const double inf = std::numeric_limits<double>::infinity();
+	uint32_t node = nodes.size();
+	nodes.emplace_back();
+
+	glm::dvec3 bmin(inf), bmax(-inf), cmin(inf), cmax(-inf);
+	for (uint32_t k = begin; k < end; k++)
+	{
+		uint32_t p = _primIndices[k];
+		bmin = glm::min(bmin, state.primMin[p]);
+		bmax = glm::max(bmax, state.primMax[p]);
+		cmin = glm::min(cmin, state.centroid[p]);
+		cmax = glm::max(cmax, state.centroid[p]);
+	}
+	nodes[node].setBounds(bmin, bmax);
+	nodes[node].offset = begin;
+	nodes[node].count = end - begin;
+	nodes[node].axis = 0;
+
+	uint32_t n = end - begin;
+	if (n == 1)
+		return;
+	// split along the widest extent of the centroids
+	glm::dvec3 cextent = cmax - cmin;
+	int axis = 0;
+	if (cextent[1] > cextent[axis])
+		axis = 1;
+	if (cextent[2] > cextent[axis])
+		axis = 2;
+	// all centroids coincide, no partition can separate them
+	if (cextent[axis] <= 0.0)
+		return;
+
+	auto centroidLess = [&](uint32_t a, uint32_t b) {
+		return state.centroid[a][axis] < state.centroid[b][axis];
+	};
+	uint32_t mid;
+	if (depth >= kMedianDepth)
+	{
+		mid = begin + n / 2;
+		std::nth_element(_primIndices.begin() + begin,
+		                 _primIndices.begin() + mid,
+		                 _primIndices.begin() + end, centroidLess);
+	}
+	else
+	{
+		struct Bin
+		{
+			glm::dvec3 bmin;
+			glm::dvec3 bmax;
+			uint32_t count;
+		};
+		Bin bins[kBins];
+		for (auto& bin : bins)
+		{
+			bin.bmin = glm::dvec3(inf);
+			bin.bmax = glm::dvec3(-inf);
+			bin.count = 0;
+		}
+		double scale = kBins / cextent[axis];
+		auto binOf = [&](uint32_t p) {
+			int b = (int)((state.centroid[p][axis] - cmin[axis]) * scale);
+			return std::min(b, kBins - 1);
+		};
+		for (uint32_t k = begin; k < end; k++)
+		{
+			uint32_t p = _primIndices[k];
+			Bin& bin = bins[binOf(p)];
+			bin.bmin = glm::min(bin.bmin, state.primMin[p]);
+			bin.bmax = glm::max(bin.bmax, state.primMax[p]);
+			bin.count++;
+		}
+
+		// sweep from the right first, then evaluate every bin boundary
+		// while sweeping from the left
+		double rightArea[kBins];
+		uint32_t rightCount[kBins];
+		glm::dvec3 sweepMin(inf), sweepMax(-inf);
+		uint32_t sweepCount = 0;
+		for (int b = kBins - 1; b > 0; b--)
+		{
+			sweepMin = glm::min(sweepMin, bins[b].bmin);
+			sweepMax = glm::max(sweepMax, bins[b].bmax);
+			sweepCount += bins[b].count;
+			rightArea[b] = halfArea(sweepMin, sweepMax);
+			rightCount[b] = sweepCount;
+		}
+		double invArea = 1.0 / halfArea(bmin, bmax);
+		double bestCost = inf;
+		int bestSplit = -1;
+		sweepMin = glm::dvec3(inf);
+		sweepMax = glm::dvec3(-inf);
+		sweepCount = 0;
+		for (int b = 1; b < kBins; b++)
+		{
+			sweepMin = glm::min(sweepMin, bins[b - 1].bmin);
+			sweepMax = glm::max(sweepMax, bins[b - 1].bmax);
+			sweepCount += bins[b - 1].count;
+			if (sweepCount == 0 || rightCount[b] == 0)
+				continue;
+			double cost = kTraversalCost +
+			              (sweepCount * halfArea(sweepMin, sweepMax) +
+			               rightCount[b] * rightArea[b]) * invArea;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestSplit = b;
+			}
+		}
+
+		// keep small nodes as leaves when splitting them does not pay off
+		if (n <= (uint32_t)std::max(traceUI->getLeafSize(), 1) &&
+		    bestCost >= n)
+			return;
+		mid = std::partition(_primIndices.begin() + begin,
+		                     _primIndices.begin() + end,
+		                     [&](uint32_t p) { return binOf(p) < bestSplit; }) -
+		      _primIndices.begin();
+	}
+
+	nodes[node].count = 0;
+	nodes[node].axis = axis;
+	if (end - mid >= build_tasks::kMinObjects)
+	{
+		std::vector<Node> right;
+		auto task = build_tasks::spawn([&] {
+			build(state, right, mid, end, depth + 1);
+		});
+		build(state, nodes, begin, mid, depth + 1);
+		task.get();
+		uint32_t base = nodes.size();
+		nodes[node].offset = base;
+		for (Node child : right)
+		{
+			// leaf offsets index _primIndices and stay as they are
+			if (!child.isLeaf())
+				child.offset += base;
+			nodes.push_back(child);
+		}
+		return;
+	}
+	build(state, nodes, begin, mid, depth + 1);
+	nodes[node].offset = nodes.size();
+	build(state, nodes, mid, end, depth + 1);
+}
+
+// Depth first traversal that descends into the child on the near side of the
+// split first and skips every box starting behind the ray's tmax.  visit(k)
+// is called for the objects in the leaves that are reached and returns true
+// to end the traversal early.
+template <class T>
+template <class Visit>
+bool Bvh<T>::traverse(ray& r, Visit visit) const
+{
+	if (_nodes.empty())
+		return false;
+
+	const glm::dvec3 pos = r.getPosition();
+	const glm::dvec3& invDir = r.getInverseDirection();
+
+	uint32_t stack[bvh_sah::kMaxDepth];
+	int top = 0;
+	uint32_t current = 0;
+	for (;;)
+	{
+		const Node& node = _nodes[current];
+		double tmin = 0.0;
+		double tmax = r.getTMax();
+		bool hit = true;
+		for (int k = 0; k < 3 && hit; k++)
+		{
+			bool neg = r.getSign(k);
+			double t0 = ((neg ? node.bmax[k] : node.bmin[k]) - pos[k]) * invDir[k];
+			double t1 = ((neg ? node.bmin[k] : node.bmax[k]) - pos[k]) * invDir[k];
+			tmin = std::max(tmin, t0);
+			tmax = std::min(tmax, t1);
+			hit = tmin <= tmax + RAY_EPSILON;
+		}
+
+		if (hit && !node.isLeaf())
+		{
+			if (r.getSign(node.axis))
+			{
+				stack[top++] = current + 1;
+				current = node.offset;
+			}
+			else
+			{
+				stack[top++] = node.offset;
+				current = current + 1;
+			}
+			continue;
+		}
+		if (hit)
+		{
+			const uint32_t* prim = _primIndices.data() + node.offset;
+			for (uint32_t k = 0; k < node.count; k++)
+				if (visit(prim[k]))
+					return true;
+		}
+		if (top == 0)
+			break;
+		current = stack[--top];
+	}
+	return false;
+}
+
+template <class T>
+bool Bvh<T>::intersect(ray& r, isect& i, bool& have_one) const
+{
+	isect check_intersect;
+	traverse(r, [&](uint32_t k) {
+		if(_prims[k]->intersect(r, check_intersect))
+		{
+			// Take the earliest time of intersection
+			if (!have_one || check_intersect.getT() < i.getT())
+			{
+				i = check_intersect;
+				have_one = true;
+			}
+		}
+		return false;
+	});
+	return have_one;
+}
+
+template <class T>
+bool Bvh<T>::occluded(ray& r) const
+{
+	return traverse(r, [&](uint32_t k) { return _prims[k]->occluded(r); });
+}
+
+// Children come after their parents, so one backwards sweep over the nodes
+// updates every box after those below it.
+template <class T>
+bool Bvh<T>::refit()
+{
+	const double inf = std::numeric_limits<double>::infinity();
+	for (uint32_t k = _nodes.size(); k-- > 0;)
+	{
+		Node& node = _nodes[k];
+		glm::dvec3 bmin(inf), bmax(-inf);
+		if (node.isLeaf())
+		{
+			for (uint32_t j = 0; j < node.count; j++)
+			{
+				const BoundingBox& b = _prims[_primIndices[node.offset + j]]->getBoundingBox();
+				bmin = glm::min(bmin, b.getMin());
+				bmax = glm::max(bmax, b.getMax());
+			}
+		}
+		else
+		{
+			const Node& left = _nodes[k + 1];
+			const Node& right = _nodes[node.offset];
+			bmin = glm::min(left.lo(), right.lo());
+			bmax = glm::max(left.hi(), right.hi());
+		}
+		node.setBounds(bmin, bmax);
+	}
+	return true;
+}
+
+template <class T>
+double Bvh<T>::sahCost() const
+{
+	if (_nodes.empty())
+		return 0.0;
+	double rootArea = halfArea(_nodes[0].lo(), _nodes[0].hi());
+	if (rootArea <= 0.0)
+		return 0.0;
+	double cost = 0.0;
+	for (const auto& node : _nodes)
+	{
+		double area = halfArea(node.lo(), node.hi());
+		cost += area * (node.isLeaf() ? node.count : bvh_sah::kTraversalCost);
+	}
+	return cost / rootArea;
+}
+
+template <class T>
+AccelStats Bvh<T>::stats() const
+{
+	AccelStats s;
+	s.type = ACCEL_BVH;
+	s.nodes = _nodes.size();
+	std::vector<std::pair<uint32_t, int>> stack;
+	if (!_nodes.empty())
+		stack.emplace_back(0, 0);
+	while (!stack.empty())
+	{
+		uint32_t k = stack.back().first;
+		int depth = stack.back().second;
+		stack.pop_back();
+		if (_nodes[k].isLeaf())
+		{
+			s.addLeaf(depth, _nodes[k].count);
+			continue;
+		}
+		stack.emplace_back(_nodes[k].offset, depth + 1);
+		stack.emplace_back(k + 1, depth + 1);
+	}
+	s.references = _primIndices.size();
+	s.bytes = sizeof(*this) + _nodes.capacity() * sizeof(Node) +
+	          _primIndices.capacity() * sizeof(uint32_t) +
+	          _prims.capacity() * sizeof(T);
+	return s;
+}
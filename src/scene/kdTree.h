@@ -1,167 +1,809 @@
 #pragma once
 #include <vector>
 #include <memory>
-#include <unordered_set>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "accelerator.h"
 #include "bbox.h"
+#include "buildTasks.h"
 #include "ray.h"
 #include <iostream>
+#include <limits>
+#include <utility>
 #include "../ui/TraceUI.h"
 extern TraceUI* traceUI;
 // Note: you can put kd-tree here
 
+namespace kd_traverse {
+// no tree is built deeper than this, so it also bounds the traversal stack
+const int kMaxDepth = 64;
+// Objects referenced from several leaves are only tested once per ray.  The
+// objects tested last are remembered in a small direct mapped table.
+const int kMailboxSize = 8;
+}
+
 template <class T>
-class KdTree
+class KdTree : public Accelerator<T>
 {
 private:
+	// 16 bytes per node, laid out depth first.  The left child of an
+	// interior node directly follows it, so the near child is usually in
+	// the same cache line, and only the index of the right child is
+	// stored.  A leaf stores a range of _primIndices.
+	static const uint32_t kLeaf = 3;
+	struct Node
+	{
+		union {
+			double split;
+			uint32_t primOffset;
+		};
+		uint32_t axis;  // 0-2, or kLeaf
+		uint32_t child; // index of the right child, or leaf object count
+		bool isLeaf() const { return axis == kLeaf; }
+	};
+
+	// State of one build task.  Objects are referred to by their index in
+	// _prims, with their bounds looked up once up front and shared by all
+	// tasks.  The object lists of all nodes on the current path share one
+	// stack in work; a node's children append their lists behind it and
+	// drop them again when done.  Each task emits its subtree into its own
+	// nodes and primIndices, which are spliced into the parent task's.
+	struct BuildState
+	{
+		BuildState(const std::vector<glm::dvec3>& lo,
+		           const std::vector<glm::dvec3>& hi) :
+		   primMin(lo),
+		   primMax(hi) {}
+
+		const std::vector<glm::dvec3>& primMin;
+		const std::vector<glm::dvec3>& primMax;
+		std::vector<uint32_t> work;
+		std::vector<Node> nodes;
+		std::vector<uint32_t> primIndices;
+	};
+
 	BoundingBox _bbox;
-	std::unique_ptr<KdTree<T>> _left, _right;
-	std::vector<T> _objects;
-	void build_tree(std::vector<T>& objects, int depth);
-	bool isLeaf() const;
+	// limits of the midpoint build, tree_depth and leaf_size unless tuned
+	int _maxDepth;
+	int _leafSize;
+	std::vector<Node> _nodes;
+	// leaf contents, as indices into _prims
+	std::vector<uint32_t> _primIndices;
+	std::vector<T> _prims;
+
+	void build_tree(BuildState& state, int depth);
+	void build_midpoint(BuildState& state, std::size_t begin, std::size_t n,
+	                    int depth);
+	void build_sah(BuildState& state, std::size_t begin, std::size_t n,
+	               int depth, int maxDepth, const BoundingBox& region,
+	               int badRefines);
+	template <class Build>
+	void buildChildren(BuildState& state, uint32_t node, std::size_t mid,
+	                   std::size_t nLeft, std::size_t nRight, Build build);
+	static void splice(BuildState& state, const BuildState& subtree);
+	template <class Extent>
+	static void partition(BuildState& state, std::size_t begin,
+	                      std::size_t n, double split,
+	                      Extent extent, std::size_t& nLeft,
+	                      std::size_t& nRight);
+	std::size_t clip(BuildState& state, std::size_t begin, std::size_t n,
+	                 const BoundingBox& region, std::vector<glm::dvec3>& lo,
+	                 std::vector<glm::dvec3>& hi) const;
+	static BoundingBox bounds(const BuildState& state, std::size_t begin,
+	                          std::size_t n);
+	static uint32_t addNode(BuildState& state);
+	static void makeLeaf(BuildState& state, uint32_t node, std::size_t begin,
+	                     std::size_t n);
+	int maxDepth(uint32_t node) const;
+	bool valid() const;
+	template <class Visit>
+	bool traverse(ray& r, Visit visit) const;
 public:
 	KdTree();
 	KdTree(std::vector<T>& objects, int depth);
-	bool intersect(ray& r, isect& i, bool& have_one) const;
-	const std::unique_ptr<KdTree<T>>& getLeft() const {return _left; }
-	const std::unique_ptr<KdTree<T>>& getRight() const {return _right; }
-	std::vector<T> getObjects() const {return _objects; }
+	KdTree(std::vector<T>& objects, int depth, int maxDepth, int leafSize);
+	KdTree(std::vector<T>& objects, const std::vector<BoundingBox>& bounds,
+	       int depth, int maxDepth, int leafSize);
+	KdTree(std::vector<T>& objects, AccelReader& in);
+	bool intersect(ray& r, isect& i, bool& have_one) const override;
+	bool occluded(ray& r) const override;
+	void save(AccelWriter& out) const override;
 
 	int maxDepth() const;
 	int countLeaf() const;
+	AccelStats stats() const override;
+	double sahCost() const override;
 };
 
 // check how balanced the tree is
 template <class T>
 int KdTree<T>::maxDepth() const
 {
-	if(!this)
-	{
-		return 0;
-	}
-	if (this->isLeaf())
+	return _nodes.empty() ? 0 : maxDepth(0);
+}
+
+template <class T>
+int KdTree<T>::maxDepth(uint32_t node) const
+{
+	if (_nodes[node].isLeaf())
 	{
 		return 1;
 	}
-	return 1 + std::max(!_left ? 0 :_left->maxDepth(), !_right ? 0 :_right->maxDepth());
+	return 1 + std::max(maxDepth(node + 1), maxDepth(_nodes[node].child));
 }
 // Used to make sure all triangles are properly placed
 template <class T>
 int KdTree<T>::countLeaf() const
 {
-	if(!this)
-	{
-		return 0;
-	}
-	if (this->isLeaf())
+	return _primIndices.size();
+}
+
+template <class T>
+AccelStats KdTree<T>::stats() const
+{
+	AccelStats s;
+	s.nodes = _nodes.size();
+	std::vector<std::pair<uint32_t, int>> stack;
+	if (!_nodes.empty())
+		stack.emplace_back(0, 0);
+	while (!stack.empty())
 	{
-		return this->getObjects().size();
+		uint32_t k = stack.back().first;
+		int depth = stack.back().second;
+		stack.pop_back();
+		if (_nodes[k].isLeaf())
+		{
+			s.addLeaf(depth, _nodes[k].child);
+			continue;
+		}
+		stack.emplace_back(_nodes[k].child, depth + 1);
+		stack.emplace_back(k + 1, depth + 1);
 	}
-	return (!_left ? 0 : _left->countLeaf()) + (!_right ? 0 : _right->countLeaf());
+	s.references = _primIndices.size();
+	s.treeDepth = _maxDepth;
+	s.leafSize = _leafSize;
+	s.bytes = sizeof(*this) + _nodes.capacity() * sizeof(Node) +
+	          _primIndices.capacity() * sizeof(uint32_t) +
+	          _prims.capacity() * sizeof(T);
+	return s;
 }
 
+// Front to back traversal.  The ray's parametric interval is clipped against
+// every split plane so the near child is visited first, and the search stops
+// as soon as the ray's tmax lies inside the interval of the current leaf:
+// every node still on the stack starts further along the ray.  visit(k) is
+// called for the objects in the leaves along the way and returns true to end
+// the traversal early.
 template <class T>
-bool KdTree<T>::intersect(ray& r, isect& i, bool& have_one) const
+template <class Visit>
+bool KdTree<T>::traverse(ray& r, Visit visit) const
 {
+	struct StackEntry
+	{
+		uint32_t node;
+		double tmin, tmax;
+	};
+	StackEntry stack[kd_traverse::kMaxDepth];
+	int top = 0;
+
 	double tmin, tmax;
-	if (this->_bbox.intersect(r, tmin, tmax))
+	if (_nodes.empty() || !this->_bbox.intersect(r, tmin, tmax))
+		return false;
+	tmin = std::max(tmin, 0.0);
+	tmax = std::min(tmax, r.getTMax());
+
+	const glm::dvec3 pos = r.getPosition();
+	const glm::dvec3 dir = r.getDirection();
+	const glm::dvec3& invDir = r.getInverseDirection();
+	uint32_t mailbox[kd_traverse::kMailboxSize];
+	std::fill(mailbox, mailbox + kd_traverse::kMailboxSize, 0xffffffff);
+	uint32_t current = 0;
+	for (;;)
 	{
-		if (this->isLeaf())
+		// every hit shrinks the ray's tmax
+		if (r.getTMax() < tmin)
+			break;
+		const Node& node = _nodes[current];
+		if (!node.isLeaf())
 		{
-			isect check_intersect;
-			for (const auto& obj : _objects)
+			int axis = node.axis;
+			double split = node.split;
+			bool belowFirst = pos[axis] < split ||
+			                  (pos[axis] == split && dir[axis] <= 0.0);
+			uint32_t nearChild = belowFirst ? current + 1 : node.child;
+			uint32_t farChild = belowFirst ? node.child : current + 1;
+			double tsplit = (split - pos[axis]) * invDir[axis];
+
+			if (tsplit > tmax || tsplit <= 0.0)
+				current = nearChild;
+			else if (tsplit < tmin)
+				current = farChild;
+			else
 			{
-				if(obj->intersect(r, check_intersect))
-				{
-					// Take the earliest time of intersection
-					if (!have_one || check_intersect.getT() < i.getT())
-					{
-						i = check_intersect;
-						have_one = true;
-					}
-				}
+				stack[top++] = {farChild, tsplit, tmax};
+				current = nearChild;
+				tmax = tsplit;
 			}
+			continue;
 		}
-		else
+
+		const uint32_t* prim = _primIndices.data() + node.primOffset;
+		for (uint32_t k = 0; k < node.child; k++)
 		{
-			// do any of the children intersect?
-	        this->_left->intersect(r, i, have_one);
-	        this->_right->intersect(r, i, have_one);
+			// a hit on an object tested before has already shrunk the ray
+			uint32_t& slot = mailbox[prim[k] % kd_traverse::kMailboxSize];
+			if (slot == prim[k])
+				continue;
+			slot = prim[k];
+			if (visit(prim[k]))
+				return true;
 		}
+		// nothing left on the stack can be closer than a hit in here
+		if (r.getTMax() <= tmax || top == 0)
+			break;
+		--top;
+		current = stack[top].node;
+		tmin = stack[top].tmin;
+		tmax = stack[top].tmax;
 	}
+	return false;
+}
+
+template <class T>
+bool KdTree<T>::intersect(ray& r, isect& i, bool& have_one) const
+{
+	isect check_intersect;
+	traverse(r, [&](uint32_t k) {
+		if(_prims[k]->intersect(r, check_intersect))
+		{
+			// Take the earliest time of intersection
+			if (!have_one || check_intersect.getT() < i.getT())
+			{
+				i = check_intersect;
+				have_one = true;
+			}
+		}
+		return false;
+	});
 	return have_one;
 }
 
 template <class T>
-bool KdTree<T>::isLeaf() const { return !_left && !_right; }
+bool KdTree<T>::occluded(ray& r) const
+{
+	return traverse(r, [&](uint32_t k) { return _prims[k]->occluded(r); });
+}
 
 template <class T>
 KdTree<T>::KdTree(std::vector<T>& objects, int depth) :
-   _bbox(), 
-   _left(),
-   _right(),
-   _objects()
+   KdTree(objects, depth, traceUI->getMaxDepth(), traceUI->getLeafSize()) {}
+
+template <class T>
+KdTree<T>::KdTree(std::vector<T>& objects, int depth, int maxDepth,
+                  int leafSize) :
+   KdTree(objects, objectBounds(objects), depth, maxDepth, leafSize) {}
+
+template <class T>
+KdTree<T>::KdTree(std::vector<T>& objects,
+                  const std::vector<BoundingBox>& bounds, int depth,
+                  int maxDepth, int leafSize) :
+   _bbox(),
+   _maxDepth(maxDepth),
+   _leafSize(leafSize),
+   _nodes(),
+   _primIndices(),
+   _prims(objects)
 {
-	build_tree(objects, depth);
+	std::vector<glm::dvec3> primMin, primMax;
+	primMin.reserve(_prims.size());
+	primMax.reserve(_prims.size());
+	for (const auto& b : bounds)
+	{
+		primMin.push_back(b.getMin());
+		primMax.push_back(b.getMax());
+	}
+	BuildState state(primMin, primMax);
+	state.work.reserve(4 * _prims.size());
+	for (uint32_t k = 0; k < _prims.size(); k++)
+		state.work.push_back(k);
+	build_tree(state, depth);
+	_nodes = std::move(state.nodes);
+	_primIndices = std::move(state.primIndices);
+	_nodes.shrink_to_fit();
+	_primIndices.shrink_to_fit();
 }
 
 template <class T>
 KdTree<T>::KdTree() :
-   _bbox(), 
-   _left(),
-   _right(),
-   _objects() {}
+   _bbox(),
+   _maxDepth(0),
+   _leafSize(0),
+   _nodes(),
+   _primIndices(),
+   _prims() {}
 
 template <class T>
-void  KdTree<T>::build_tree(std::vector<T>& objects, int depth)
+KdTree<T>::KdTree(std::vector<T>& objects, AccelReader& in) :
+   _bbox(),
+   _maxDepth(0),
+   _leafSize(0),
+   _nodes(),
+   _primIndices(),
+   _prims(objects)
 {
-	// nothing here
-	if (!objects.empty())
+	glm::dvec3 bmin, bmax;
+	in.read(bmin);
+	in.read(bmax);
+	in.read(_maxDepth);
+	in.read(_leafSize);
+	in.read(_nodes);
+	in.read(_primIndices);
+	if (!in.ok || !valid())
 	{
-		this->_bbox = objects[0]->getBoundingBox();
-		// Make a bounding box that fits all the objects
-		for(int i = 1; i < objects.size(); i++)
+		in.ok = false;
+		_nodes.clear();
+		_primIndices.clear();
+	}
+	else if (!_nodes.empty())
+		_bbox = BoundingBox(bmin, bmax);
+}
+
+template <class T>
+void KdTree<T>::save(AccelWriter& out) const
+{
+	out.write(_bbox.getMin());
+	out.write(_bbox.getMax());
+	out.write(_maxDepth);
+	out.write(_leafSize);
+	out.write(_nodes);
+	out.write(_primIndices);
+}
+
+// Checks a tree read from the cache before it is traversed: every index in
+// range, children after their parents and no deeper than the traversal
+// stack allows.
+template <class T>
+bool KdTree<T>::valid() const
+{
+	std::vector<int> depth(_nodes.size(), 1);
+	for (uint32_t k = 0; k < _nodes.size(); k++)
+	{
+		const Node& node = _nodes[k];
+		if (depth[k] > kd_traverse::kMaxDepth)
+			return false;
+		if (node.isLeaf())
 		{
-			this->_bbox.merge(objects[i]->getBoundingBox());
+			if (node.primOffset > _primIndices.size() ||
+			    node.child > _primIndices.size() - node.primOffset)
+				return false;
+			continue;
 		}
+		if (node.axis > 2 || node.child <= k + 1 || node.child >= _nodes.size())
+			return false;
+		depth[k + 1] = depth[node.child] = depth[k] + 1;
+	}
+	for (uint32_t p : _primIndices)
+		if (p >= _prims.size())
+			return false;
+	return true;
+}
+
+template <class T>
+uint32_t KdTree<T>::addNode(BuildState& state)
+{
+	state.nodes.emplace_back();
+	return state.nodes.size() - 1;
+}
+
+template <class T>
+void KdTree<T>::makeLeaf(BuildState& state, uint32_t node, std::size_t begin,
+                         std::size_t n)
+{
+	state.nodes[node].primOffset = state.primIndices.size();
+	state.nodes[node].axis = kLeaf;
+	state.nodes[node].child = n;
+	state.primIndices.insert(state.primIndices.end(),
+	                         state.work.begin() + begin,
+	                         state.work.begin() + begin + n);
+}
+
+// Builds both children of node from the lists of the work stack at mid.
+// build(state, begin, n, right) builds one child.  A large right child is
+// built by a task of its own while this one builds the left, and spliced in
+// behind it, which gives the same layout as building one after the other.
+template <class T>
+template <class Build>
+void KdTree<T>::buildChildren(BuildState& state, uint32_t node,
+                              std::size_t mid, std::size_t nLeft,
+                              std::size_t nRight, Build build)
+{
+	if (nRight >= build_tasks::kMinObjects)
+	{
+		BuildState right(state.primMin, state.primMax);
+		right.work.reserve(4 * nRight);
+		right.work.assign(state.work.begin() + mid + nLeft,
+		                  state.work.begin() + mid + nLeft + nRight);
+		auto task = build_tasks::spawn([&] { build(right, 0, nRight, true); });
+		build(state, mid, nLeft, false);
+		task.get();
+		state.work.resize(mid);
+		state.nodes[node].child = state.nodes.size();
+		splice(state, right);
+		return;
+	}
+	build(state, mid, nLeft, false);
+	state.work.resize(mid + nLeft + nRight);
+	state.nodes[node].child = state.nodes.size();
+	build(state, mid + nLeft, nRight, true);
+	state.work.resize(mid);
+}
+
+// Appends the output of subtree, whose indices start from zero.
+template <class T>
+void KdTree<T>::splice(BuildState& state, const BuildState& subtree)
+{
+	uint32_t nodeBase = state.nodes.size();
+	uint32_t primBase = state.primIndices.size();
+	for (Node node : subtree.nodes)
+	{
+		if (node.isLeaf())
+			node.primOffset += primBase;
+		else
+			node.child += nodeBase;
+		state.nodes.push_back(node);
+	}
+	state.primIndices.insert(state.primIndices.end(),
+	                         subtree.primIndices.begin(),
+	                         subtree.primIndices.end());
+}
+
+template <class T>
+BoundingBox KdTree<T>::bounds(const BuildState& state, std::size_t begin,
+                              std::size_t n)
+{
+	BoundingBox bbox;
+	// Make a bounding box that fits all the objects
+	for (std::size_t k = begin; k < begin + n; k++)
+	{
+		uint32_t p = state.work[k];
+		bbox.merge(BoundingBox(state.primMin[p], state.primMax[p]));
 	}
+	return bbox;
+}
+
+template <class T>
+void  KdTree<T>::build_tree(BuildState& state, int depth)
+{
+	std::size_t n = state.work.size();
+	_bbox = bounds(state, 0, n);
+	// perfect splits need the cell bounds, which only the SAH build tracks
+	if (traceUI->kdSahSwitch() || traceUI->kdPerfectSplitsSwitch())
+	{
+		// The SAH decides when to stop on its own, the depth limit is only
+		// a safety net against pathological inputs.
+		int maxDepth = depth + 8 + (int)std::round(1.3 * std::log2(std::max<std::size_t>(n, 1)));
+		maxDepth = std::min(maxDepth, kd_traverse::kMaxDepth - 1);
+		// neither limit of the midpoint build applies
+		_maxDepth = _leafSize = 0;
+		build_sah(state, 0, n, depth, maxDepth, _bbox, 0);
+	}
+	else
+		build_midpoint(state, 0, n, depth);
+}
+
+template <class T>
+void KdTree<T>::build_midpoint(BuildState& state, std::size_t begin,
+                               std::size_t n, int depth)
+{
+	uint32_t node = addNode(state);
 	// base case
-    if (objects.size() < traceUI->getLeafSize() || depth >= traceUI->getMaxDepth())
+    if (n < (std::size_t)_leafSize || depth >= _maxDepth ||
+        depth >= kd_traverse::kMaxDepth - 1)
     {
-		this->_objects = objects;
+		makeLeaf(state, node, begin, n);
 		return;
     }
-
-    std::vector<T> left_objects;
-    std::vector<T> right_objects;
+	BoundingBox bbox = bounds(state, begin, n);
+	std::size_t mid = state.work.size();
+	std::size_t nLeft = 0, nRight = 0;
 
     // start with the first longest axis
     int cur_axis = 0;
     // ordered vector of axises
-    auto ordered_axis = _bbox.longestAxis();
+    auto ordered_axis = bbox.longestAxis();
 
     // partition each object into the halves based on the longest axis of the current bb
-    // if a vector ends up empty then try again with the second longest
-    while (cur_axis < 3 && (left_objects.empty() || right_objects.empty()))
+    // if that does not separate anything then try again with the second longest
+    bool separated = false;
+    while (cur_axis < 3 && !separated)
     {
     	// get longest axis
 		int	m_axis = ordered_axis[cur_axis++];
     	// get pivot point
 
-		auto pivot = _bbox.midPoint()[m_axis];
+		auto pivot = bbox.midPoint()[m_axis];
     	// reset
-    	left_objects.clear();
-    	right_objects.clear();
-		
-    	// partition
-		for (const auto& obj : objects)
+		state.work.resize(mid);
+
+		partition(state, begin, n, pivot, [&](std::size_t k) {
+			uint32_t p = state.work[k];
+			return std::make_pair(state.primMin[p][m_axis],
+			                      state.primMax[p][m_axis]);
+		}, nLeft, nRight);
+		separated = nLeft < n && nRight < n;
+		state.nodes[node].axis = m_axis;
+		state.nodes[node].split = pivot;
+    }
+	// every object straddles every midpoint, splitting would only copy them
+	if (!separated)
+	{
+		state.work.resize(mid);
+		makeLeaf(state, node, begin, n);
+		return;
+	}
+	buildChildren(state, node, mid, nLeft, nRight,
+	              [this, depth](BuildState& s, std::size_t b, std::size_t c, bool) {
+		build_midpoint(s, b, c, depth + 1);
+	});
+}
+
+// Appends the indices of the objects below the plane and then those above
+// it to the work stack.  Objects straddling the plane (or lying in it) are
+// referenced from both sides as needed.  extent(k) gives the (lo, hi) extent
+// along the split axis of the object at k in the work stack.
+template <class T>
+template <class Extent>
+void KdTree<T>::partition(BuildState& state, std::size_t begin, std::size_t n,
+                          double split, Extent extent,
+                          std::size_t& nLeft, std::size_t& nRight)
+{
+	nLeft = nRight = 0;
+	for (std::size_t k = begin; k < begin + n; k++)
+	{
+		std::pair<double, double> e = extent(k);
+		if (e.first < split || (e.first == split && e.second == split))
 		{
-			auto box_axis_value = obj->getBoundingBox().midPoint()[m_axis];
-			if (box_axis_value < pivot)
-				left_objects.push_back(obj);
-			else
-				right_objects.push_back(obj);
+			state.work.push_back(state.work[k]);
+			nLeft++;
 		}
-    }
-	this->_left = std::make_unique<KdTree<T>>(left_objects, depth + 1);
-	this->_right = std::make_unique<KdTree<T>>(right_objects, depth + 1);
+	}
+	for (std::size_t k = begin; k < begin + n; k++)
+	{
+		if (extent(k).second > split)
+		{
+			state.work.push_back(state.work[k]);
+			nRight++;
+		}
+	}
+}
+
+// Fills lo and hi with the bounds of every object in the list at begin, cut
+// down to region.  With perfect splits the objects clip themselves to it,
+// and those that turn out not to pass through region at all are dropped
+// from the list.  Returns the new length of the list.
+template <class T>
+std::size_t KdTree<T>::clip(BuildState& state, std::size_t begin,
+                            std::size_t n, const BoundingBox& region,
+                            std::vector<glm::dvec3>& lo,
+                            std::vector<glm::dvec3>& hi) const
+{
+	bool perfect = traceUI->kdPerfectSplitsSwitch();
+	glm::dvec3 rmin = region.getMin();
+	glm::dvec3 rmax = region.getMax();
+	lo.reserve(n);
+	hi.reserve(n);
+	std::size_t kept = 0;
+	for (std::size_t k = begin; k < begin + n; k++)
+	{
+		uint32_t p = state.work[k];
+		glm::dvec3 a = glm::max(state.primMin[p], rmin);
+		glm::dvec3 b = glm::min(state.primMax[p], rmax);
+		if (perfect && !_prims[p]->clipBounds(region, a, b))
+			continue;
+		state.work[begin + kept++] = p;
+		lo.push_back(a);
+		hi.push_back(b);
+	}
+	return kept;
+}
+
+// Surface area heuristic build.  Candidate planes are evaluated on
+// the kBins bin boundaries of every axis, and a node stays a leaf when no
+// split is cheaper than intersecting all of its objects.
+namespace kd_sah {
+const int kBins = 32;
+const double kTraversalCost = 1.0;
+const double kIntersectCost = 80.0;
+// favour splits that cut off empty space
+const double kEmptyBonus = 0.5;
+const int kMaxBadRefines = 3;
+}
+
+template <class T>
+void KdTree<T>::build_sah(BuildState& state, std::size_t begin, std::size_t n,
+                          int depth, int maxDepth, const BoundingBox& region,
+                          int badRefines)
+{
+	using namespace kd_sah;
+	uint32_t node = addNode(state);
+	std::vector<glm::dvec3> clipMin, clipMax;
+	n = clip(state, begin, n, region, clipMin, clipMax);
+	const double leafCost = kIntersectCost * n;
+	if (n <= 1 || depth >= maxDepth)
+	{
+		makeLeaf(state, node, begin, n);
+		return;
+	}
+
+	glm::dvec3 rmin = region.getMin();
+	glm::dvec3 rmax = region.getMax();
+	glm::dvec3 extent = rmax - rmin;
+	BoundingBox tmp = region;
+	double invArea = 1.0 / tmp.area();
+
+	double bestCost = std::numeric_limits<double>::infinity();
+	int bestAxis = -1;
+	double bestSplit = 0.0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (extent[axis] <= 0.0)
+			continue;
+		// bin the clipped extent of every object along this axis
+		int starts[kBins] = {0};
+		int ends[kBins] = {0};
+		double scale = kBins / extent[axis];
+		for (std::size_t k = 0; k < n; k++)
+		{
+			double lo = clipMin[k][axis];
+			double hi = clipMax[k][axis];
+			int s = glm::clamp((int)((lo - rmin[axis]) * scale), 0, kBins - 1);
+			int e = glm::clamp((int)((hi - rmin[axis]) * scale), 0, kBins - 1);
+			starts[s]++;
+			ends[e]++;
+		}
+
+		int other0 = (axis + 1) % 3;
+		int other1 = (axis + 2) % 3;
+		double capArea = 2.0 * extent[other0] * extent[other1];
+		double perimeter = 2.0 * (extent[other0] + extent[other1]);
+
+		// sweep over the bin boundaries
+		int nLeft = 0;
+		int nRight = n;
+		for (int k = 1; k < kBins; k++)
+		{
+			nLeft += starts[k - 1];
+			nRight -= ends[k - 1];
+			double split = rmin[axis] + extent[axis] * k / kBins;
+			double leftArea = capArea + perimeter * (split - rmin[axis]);
+			double rightArea = capArea + perimeter * (rmax[axis] - split);
+			double bonus = (nLeft == 0 || nRight == 0) ? kEmptyBonus : 0.0;
+			double cost = kTraversalCost + kIntersectCost * (1.0 - bonus) *
+			              (leftArea * invArea * nLeft + rightArea * invArea * nRight);
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = split;
+			}
+		}
+	}
+
+	// cost based termination, allowing a few splits that do not pay off
+	// right away in case their children do
+	if (bestCost > leafCost)
+		badRefines++;
+	if (bestAxis < 0 || (bestCost > 4.0 * leafCost && n < 16) ||
+	    badRefines == kMaxBadRefines)
+	{
+		makeLeaf(state, node, begin, n);
+		return;
+	}
+
+	std::size_t mid = state.work.size();
+	std::size_t nLeft, nRight;
+	partition(state, begin, n, bestSplit, [&](std::size_t k) {
+		return std::make_pair(clipMin[k - begin][bestAxis],
+		                      clipMax[k - begin][bestAxis]);
+	}, nLeft, nRight);
+	// the children clip for themselves, no need to hold on to these
+	clipMin = std::vector<glm::dvec3>();
+	clipMax = std::vector<glm::dvec3>();
+
+	state.nodes[node].axis = bestAxis;
+	state.nodes[node].split = bestSplit;
+	glm::dvec3 leftMax = rmax;
+	leftMax[bestAxis] = bestSplit;
+	glm::dvec3 rightMin = rmin;
+	rightMin[bestAxis] = bestSplit;
+	BoundingBox leftRegion(rmin, leftMax);
+	BoundingBox rightRegion(rightMin, rmax);
+	buildChildren(state, node, mid, nLeft, nRight,
+	              [&](BuildState& s, std::size_t b, std::size_t c, bool right) {
+		build_sah(s, b, c, depth + 1, maxDepth,
+		          right ? rightRegion : leftRegion, badRefines);
+	});
+}
+
+// The same estimate as for the BVHs, in object intersections, with a node
+// visit costing kTraversalCost / kIntersectCost of one.  The cells are
+// recomputed from the split planes on the way down.
+template <class T>
+double KdTree<T>::sahCost() const
+{
+	auto halfArea = [](const glm::dvec3& bmin, const glm::dvec3& bmax) {
+		glm::dvec3 d = glm::max(bmax - bmin, glm::dvec3(0.0));
+		return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+	};
+	if (_nodes.empty())
+		return 0.0;
+	double rootArea = halfArea(_bbox.getMin(), _bbox.getMax());
+	if (rootArea <= 0.0)
+		return 0.0;
+	struct Cell
+	{
+		uint32_t node;
+		glm::dvec3 bmin, bmax;
+	};
+	std::vector<Cell> stack;
+	stack.push_back({0, _bbox.getMin(), _bbox.getMax()});
+	double cost = 0.0;
+	while (!stack.empty())
+	{
+		Cell cell = stack.back();
+		stack.pop_back();
+		const Node& node = _nodes[cell.node];
+		double area = halfArea(cell.bmin, cell.bmax);
+		if (node.isLeaf())
+		{
+			cost += area * node.child;
+			continue;
+		}
+		cost += area * kd_sah::kTraversalCost / kd_sah::kIntersectCost;
+		Cell left = {cell.node + 1, cell.bmin, cell.bmax};
+		Cell right = {node.child, cell.bmin, cell.bmax};
+		left.bmax[node.axis] = node.split;
+		right.bmin[node.axis] = node.split;
+		stack.push_back(right);
+		stack.push_back(left);
+	}
+	return cost / rootArea;
+}
+
+// Per structure choice of the midpoint build's depth and leaf size limits
+// ("kd_autotune"), in place of tree_depth and leaf_size.  A few builds
+// around the usual depth rule are compared by sahCost().  Deeper trees and
+// smaller leaves come later and are only taken when they lower the cost by
+// kMinGain, so memory does not grow for a marginal gain.
+namespace kd_autotune {
+const int kDepthSteps[] = {-4, 0, 4};
+const int kLeafSizes[] = {8, 4, 2};
+const double kMinGain = 0.02;
+}
+
+template <class T>
+std::unique_ptr<KdTree<T>> tunedKdTree(std::vector<T>& objects,
+                                       const std::vector<BoundingBox>& bounds)
+{
+	using namespace kd_autotune;
+	int base = 8 + (int)std::round(1.3 * std::log2(std::max<std::size_t>(objects.size(), 1)));
+	std::unique_ptr<KdTree<T>> best;
+	double bestCost = 0.0;
+	for (int step : kDepthSteps)
+	{
+		int depth = std::max(1, std::min(base + step, kd_traverse::kMaxDepth - 1));
+		for (int leafSize : kLeafSizes)
+		{
+			auto tree = std::make_unique<KdTree<T>>(objects, bounds, 0, depth, leafSize);
+			double cost = tree->sahCost();
+			if (!best || cost < (1.0 - kMinGain) * bestCost)
+			{
+				best = std::move(tree);
+				bestCost = cost;
+			}
+		}
+	}
+	return best;
 }
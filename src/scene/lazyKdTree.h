@@ -0,0 +1,270 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include "accelerator.h"
+#include "bbox.h"
+#include "kdTree.h"
+#include "ray.h"
+#include "../ui/TraceUI.h"
+extern TraceUI* traceUI;
+
+// Kd-tree that is built as rays go through it ("kd_lazy" in the JSON
+// settings).  Construction only looks up the objects' bounds; a node is
+// split by the first ray that reaches it, with the midpoint rule and limits
+// of the default build.  Geometry no ray comes near is never refined, so
+// the first pixels come out long before a full build would be done.  Each
+// node is split exactly once, whichever thread gets there first, and the
+// other threads reaching it wait for that split.
+template <class T>
+class LazyKdTree : public Accelerator<T>
+{
+private:
+	static const int kLeaf = 3;
+	struct Node
+	{
+		explicit Node(int d) : depth(d) {}
+
+		std::once_flag once;
+		// set once the node has been looked at, see expand()
+		std::atomic<bool> expanded{false};
+		int depth;
+		int axis = kLeaf; // 0-2, or kLeaf
+		double split = 0.0;
+		std::unique_ptr<Node> children[2];
+		// objects in the cell, as indices into _prims.  Emptied when the
+		// node is split.
+		std::vector<uint32_t> prims;
+		bool isLeaf() const { return axis == kLeaf; }
+	};
+
+	BoundingBox _bbox;
+	std::unique_ptr<Node> _root;
+	std::vector<T> _prims;
+	// per object bounds, looked up once by the constructor
+	std::vector<glm::dvec3> _primMin;
+	std::vector<glm::dvec3> _primMax;
+
+	void expand(Node& node) const;
+	void split(Node& node) const;
+	template <class Visit>
+	bool traverse(ray& r, Visit visit) const;
+public:
+	LazyKdTree(std::vector<T>& objects);
+	LazyKdTree(std::vector<T>& objects, const std::vector<BoundingBox>& bounds);
+	bool intersect(ray& r, isect& i, bool& have_one) const override;
+	bool occluded(ray& r) const override;
+	// only covers the nodes split so far
+	AccelStats stats() const override;
+	// there is nothing worth keeping until rays went through it, so
+	// nothing is written and the tree is never cached (see
+	// makeCachedAccelerator())
+	void save(AccelWriter&) const override {}
+};
+
+template <class T>
+LazyKdTree<T>::LazyKdTree(std::vector<T>& objects) :
+   LazyKdTree(objects, objectBounds(objects)) {}
+
+template <class T>
+LazyKdTree<T>::LazyKdTree(std::vector<T>& objects,
+                          const std::vector<BoundingBox>& bounds) :
+   _bbox(),
+   _root(new Node(0)),
+   _prims(objects)
+{
+	_primMin.reserve(_prims.size());
+	_primMax.reserve(_prims.size());
+	_root->prims.reserve(_prims.size());
+	for (uint32_t k = 0; k < _prims.size(); k++)
+	{
+		const BoundingBox& b = bounds[k];
+		_primMin.push_back(b.getMin());
+		_primMax.push_back(b.getMax());
+		_bbox.merge(b);
+		_root->prims.push_back(k);
+	}
+}
+
+template <class T>
+void LazyKdTree<T>::expand(Node& node) const
+{
+	// the flag spares every visit after the split the cost of call_once
+	if (node.expanded.load(std::memory_order_acquire))
+		return;
+	std::call_once(node.once, [&] {
+		split(node);
+		node.expanded.store(true, std::memory_order_release);
+	});
+}
+
+// Same rule as KdTree::build_midpoint(): halve the longest axis of the
+// objects' bounds, or the next one if that does not separate any of them.
+template <class T>
+void LazyKdTree<T>::split(Node& node) const
+{
+	std::size_t n = node.prims.size();
+	if (n < (std::size_t)traceUI->getLeafSize() || node.depth >= traceUI->getMaxDepth() ||
+	    node.depth >= kd_traverse::kMaxDepth - 1)
+		return;
+	BoundingBox bbox;
+	for (uint32_t p : node.prims)
+		bbox.merge(BoundingBox(_primMin[p], _primMax[p]));
+
+	auto ordered_axis = bbox.longestAxis();
+	std::vector<uint32_t> left, right;
+	for (int k = 0; k < 3; k++)
+	{
+		int axis = ordered_axis[k];
+		double split = bbox.midPoint()[axis];
+		left.clear();
+		right.clear();
+		// the same sides as KdTree::partition()
+		for (uint32_t p : node.prims)
+		{
+			double lo = _primMin[p][axis], hi = _primMax[p][axis];
+			if (lo < split || (lo == split && hi == split))
+				left.push_back(p);
+			if (hi > split)
+				right.push_back(p);
+		}
+		if (left.size() < n && right.size() < n)
+		{
+			node.children[0].reset(new Node(node.depth + 1));
+			node.children[1].reset(new Node(node.depth + 1));
+			node.children[0]->prims = std::move(left);
+			node.children[1]->prims = std::move(right);
+			node.split = split;
+			node.axis = axis;
+			node.prims = std::vector<uint32_t>();
+			return;
+		}
+	}
+	// every object straddles every midpoint, splitting would only copy them
+}
+
+// KdTree::traverse(), splitting the nodes on the way
+template <class T>
+template <class Visit>
+bool LazyKdTree<T>::traverse(ray& r, Visit visit) const
+{
+	struct StackEntry
+	{
+		Node* node;
+		double tmin, tmax;
+	};
+	StackEntry stack[kd_traverse::kMaxDepth];
+	int top = 0;
+
+	double tmin, tmax;
+	if (_prims.empty() || !this->_bbox.intersect(r, tmin, tmax))
+		return false;
+	tmin = std::max(tmin, 0.0);
+	tmax = std::min(tmax, r.getTMax());
+
+	const glm::dvec3 pos = r.getPosition();
+	const glm::dvec3 dir = r.getDirection();
+	const glm::dvec3& invDir = r.getInverseDirection();
+	uint32_t mailbox[kd_traverse::kMailboxSize];
+	std::fill(mailbox, mailbox + kd_traverse::kMailboxSize, 0xffffffff);
+	Node* current = _root.get();
+	for (;;)
+	{
+		if (r.getTMax() < tmin)
+			break;
+		expand(*current);
+		if (!current->isLeaf())
+		{
+			int axis = current->axis;
+			double split = current->split;
+			bool belowFirst = pos[axis] < split ||
+			                  (pos[axis] == split && dir[axis] <= 0.0);
+			Node* nearChild = current->children[belowFirst ? 0 : 1].get();
+			Node* farChild = current->children[belowFirst ? 1 : 0].get();
+			double tsplit = (split - pos[axis]) * invDir[axis];
+
+			if (tsplit > tmax || tsplit <= 0.0)
+				current = nearChild;
+			else if (tsplit < tmin)
+				current = farChild;
+			else
+			{
+				stack[top++] = {farChild, tsplit, tmax};
+				current = nearChild;
+				tmax = tsplit;
+			}
+			continue;
+		}
+
+		for (uint32_t p : current->prims)
+		{
+			uint32_t& slot = mailbox[p % kd_traverse::kMailboxSize];
+			if (slot == p)
+				continue;
+			slot = p;
+			if (visit(p))
+				return true;
+		}
+		if (r.getTMax() <= tmax || top == 0)
+			break;
+		--top;
+		current = stack[top].node;
+		tmin = stack[top].tmin;
+		tmax = stack[top].tmax;
+	}
+	return false;
+}
+
+template <class T>
+bool LazyKdTree<T>::intersect(ray& r, isect& i, bool& have_one) const
+{
+	isect check_intersect;
+	traverse(r, [&](uint32_t k) {
+		if(_prims[k]->intersect(r, check_intersect))
+		{
+			if (!have_one || check_intersect.getT() < i.getT())
+			{
+				i = check_intersect;
+				have_one = true;
+			}
+		}
+		return false;
+	});
+	return have_one;
+}
+
+template <class T>
+bool LazyKdTree<T>::occluded(ray& r) const
+{
+	return traverse(r, [&](uint32_t k) { return _prims[k]->occluded(r); });
+}
+
+template <class T>
+AccelStats LazyKdTree<T>::stats() const
+{
+	AccelStats s;
+	s.bytes = sizeof(*this) + _prims.capacity() * sizeof(T) +
+	          2 * _primMin.capacity() * sizeof(glm::dvec3);
+	std::vector<const Node*> stack(1, _root.get());
+	while (!stack.empty())
+	{
+		const Node* node = stack.back();
+		stack.pop_back();
+		s.nodes++;
+		s.bytes += sizeof(Node) + node->prims.capacity() * sizeof(uint32_t);
+		// nodes not reached yet count as the leaves they are for now
+		if (!node->expanded.load(std::memory_order_acquire) || node->isLeaf())
+		{
+			s.addLeaf(node->depth, node->prims.size());
+			s.references += node->prims.size();
+			continue;
+		}
+		stack.push_back(node->children[1].get());
+		stack.push_back(node->children[0].get());
+	}
+	return s;
+}
@@ -1,5 +1,6 @@
 #include <cmath>
 #include <iostream>
+#include <limits>
 
 #include "light.h"
 #include <glm/glm.hpp>
@@ -81,7 +82,14 @@ glm::dvec3 DirectionalLight::shadowAttenuation(const ray& r, const glm::dvec3& p
 {
 
 	ray ray_to_light (p, this->getDirection(p), glm::dvec3(1,1,1), ray::SHADOW);
-	return dsaHelper(ray_to_light, p);
+	// light passing through translucent objects has to be followed hit by
+	// hit, which also finds any opaque blocker
+	if (scene->hasTranslucent())
+		return dsaHelper(ray_to_light, p);
+	// otherwise any blocker ends it; no need to find the nearest one
+	if (scene->occluded(ray_to_light, std::numeric_limits<double>::infinity()))
+		return glm::dvec3(0, 0, 0);
+	return color * ray_to_light.getAtten();
 
 }
 
@@ -122,7 +130,12 @@ glm::dvec3 PointLight::shadowAttenuation(const ray& r, const glm::dvec3& p) cons
 {
 	 ray ray_to_light (p,this->getDirection(p), glm::dvec3(1.0,1.0,1.0), ray::SHADOW);
 
-	 return psaHelper(ray_to_light, p);
+	 // see DirectionalLight::shadowAttenuation()
+	 if (scene->hasTranslucent())
+		 return psaHelper(ray_to_light, p);
+	 if (scene->occluded(ray_to_light, glm::length(position - p)))
+		 return glm::dvec3(0, 0, 0);
+	 return color * ray_to_light.getAtten();
 
 }
 
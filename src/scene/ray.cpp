@@ -1,3 +1,6 @@
+#include <memory>
+#include <vector>
+
 #include "ray.h"
 #include "../ui/TraceUI.h"
 #include "material.h"
@@ -9,16 +12,52 @@ const Material& isect::getMaterial() const
 	return material ? *material : obj->getMaterial();
 }
 
+namespace hit_materials {
+namespace {
+// materials are handed out chunk by chunk, so the ones in use never move
+const std::size_t kChunk = 64;
+
+struct Store
+{
+	std::vector<std::unique_ptr<Material[]>> chunks;
+	std::size_t used = 0;
+};
+
+thread_local Store store;
+}
+
+const Material* add(const Material& m)
+{
+	std::size_t chunk = store.used / kChunk;
+	if (chunk == store.chunks.size())
+		store.chunks.emplace_back(new Material[kChunk]);
+	Material* slot = &store.chunks[chunk][store.used++ % kChunk];
+	*slot = m;
+	return slot;
+}
+
+void clear()
+{
+	store.used = 0;
+}
+}
+
 ray::ray(const glm::dvec3& pp,
 	 const glm::dvec3& dd,
 	 const glm::dvec3& w,
          RayType tt)
         : p(pp), d(dd), atten(w), t(tt)
 {
+	updateInverse();
 	TraceUI::addRay(ray_thread_id);
 }
 
-ray::ray(const ray& other) : p(other.p), d(other.d), atten(other.atten)
+ray::ray(const ray& other)
+        : source_IOR(other.source_IOR), p(other.p), d(other.d),
+          invD(other.invD), atten(other.atten), t(other.t),
+          sign{other.sign[0], other.sign[1], other.sign[2]},
+          shearAxis{other.shearAxis[0], other.shearAxis[1], other.shearAxis[2]},
+          shear(other.shear), tmax(other.tmax)
 {
 	TraceUI::addRay(ray_thread_id);
 }
@@ -31,8 +70,17 @@ ray& ray::operator=(const ray& other)
 {
 	p     = other.p;
 	d     = other.d;
+	invD  = other.invD;
 	atten = other.atten;
 	t     = other.t;
+	sign[0] = other.sign[0];
+	sign[1] = other.sign[1];
+	sign[2] = other.sign[2];
+	for (int k = 0; k < 3; k++)
+		shearAxis[k] = other.shearAxis[k];
+	shear = other.shear;
+	tmax  = other.tmax;
+	source_IOR = other.source_IOR;
 	return *this;
 }
 
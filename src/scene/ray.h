@@ -12,7 +12,11 @@
 
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <utility>
 #include "material.h"
 
 class SceneObject;
@@ -23,6 +27,8 @@ class isect;
  */
 extern thread_local unsigned int ray_thread_id;
 
+const double RAY_EPSILON = 0.00000001;
+
 // A ray has a position where the ray starts, and a direction (which should
 // always be normalized!)
 
@@ -45,37 +51,86 @@ public:
 	glm::dvec3 getAtten() const { return atten; }
 	RayType type() const { return t; }
 
+	// Reciprocal of the direction, so box tests can multiply instead of
+	// divide.  Zero components map to a huge finite value rather than
+	// infinity, which keeps 0 * invD from turning into NaN.
+	const glm::dvec3& getInverseDirection() const { return invD; }
+	// 1 if the direction is negative along axis, 0 otherwise
+	int getSign(int axis) const { return sign[axis]; }
+	// Setup of the watertight triangle test (Woop, Benthin and Wald 2013).
+	// Axis 2 is the one the direction is largest along, 0 and 1 are the
+	// others, ordered to keep the winding.  The shear (Sx, Sy, Sz) maps
+	// the direction onto (0, 0, 1) in that frame.
+	int getShearAxis(int k) const { return shearAxis[k]; }
+	const glm::dvec3& getShear() const { return shear; }
+
+	// Only hits in (RAY_EPSILON, tmax] count.  Intersection routines shrink
+	// tmax to every hit they report, so whatever is tested afterwards can
+	// skip anything further away.
+	double getTMax() const { return tmax; }
+	void setTMax(double tt) { tmax = tt; }
+
 	void setPosition(const glm::dvec3& pp) { p = pp; }
-	void setDirection(const glm::dvec3& dd) { d = dd; }
+	void setDirection(const glm::dvec3& dd)
+	{
+		d = dd;
+		updateInverse();
+	}
 
 	double source_IOR = 1.0;
 private:
+	void updateInverse()
+	{
+		for (int k = 0; k < 3; k++) {
+			sign[k] = d[k] < 0.0;
+			invD[k] = d[k] != 0.0 ? 1.0 / d[k] : (sign[k] ? -1e300 : 1e300);
+		}
+		glm::dvec3 a(std::abs(d[0]), std::abs(d[1]), std::abs(d[2]));
+		int kz = a[0] > a[1] ? (a[0] > a[2] ? 0 : 2) : (a[1] > a[2] ? 1 : 2);
+		int kx = (kz + 1) % 3;
+		int ky = (kx + 1) % 3;
+		if (d[kz] < 0.0)
+			std::swap(kx, ky);
+		shearAxis[0] = kx;
+		shearAxis[1] = ky;
+		shearAxis[2] = kz;
+		shear = d[kz] != 0.0 ? glm::dvec3(d[kx] / d[kz], d[ky] / d[kz], 1.0 / d[kz])
+		                     : glm::dvec3(0.0);
+	}
+
 	glm::dvec3 p;
 	glm::dvec3 d;
+	glm::dvec3 invD;
 	glm::dvec3 atten;
 	RayType t;
+	int sign[3];
+	int shearAxis[3];
+	glm::dvec3 shear;
+	double tmax = std::numeric_limits<double>::infinity();
 };
 
 
-// The description of an intersection point.
+// Materials of hits that have one of their own, such as one interpolated
+// from a mesh's per vertex materials.  Each thread has its own store.
+// RayTracer empties it before every camera ray, and the memory is reused
+// for the next one, so tracing allocates nothing once it has grown.
+namespace hit_materials {
+const Material* add(const Material& m);
+void clear();
+}
+
+// The description of an intersection point.  It owns nothing, so the
+// accelerators copy candidate hits around without allocating.
 
 class isect {
 public:
-	isect() : obj(NULL), t(0.0), N(), material(nullptr) {}
-	isect(const isect& other)
-	{
-		copyFromOther(other);
-	}
-
-	~isect() { }
-
-	isect& operator=(const isect& other)
-	{
-		copyFromOther(other);
-		return *this;
-	}
+	isect() : obj(NULL), prim(0), t(0.0), N(), material(nullptr) {}
 
 	void setObject(const SceneObject* o) { obj = o; }
+	const SceneObject* getObject() const { return obj; }
+	// which part of the object was hit, e.g. the face of a mesh
+	void setPrimitive(uint32_t p) { prim = p; }
+	uint32_t getPrimitive() const { return prim; }
 
 	// Get/Set Time of flight
 	void setT(double tt) { t = tt; }
@@ -84,19 +139,15 @@ public:
 	void setN(const glm::dvec3& n) { N = n; }
 	glm::dvec3 getN() const { return N; }
 
-	void setMaterial(const Material& m)
-	{
-		if (material)
-			*material = m;
-		else
-			material.reset(new Material(m));
-	}
+	// m has to outlive the hit, see hit_materials
+	void setMaterial(const Material& m) { material = &m; }
 	void setUVCoordinates(const glm::dvec2& coords)
 	{
 		uvCoordinates = coords;
 	}
 	glm::dvec2 getUVCoordinates() const { return uvCoordinates; }
 	void setBary(const glm::dvec3& weights) { bary = weights; }
+	glm::dvec3 getBary() const { return bary; }
 	void setBary(const double alpha, const double beta, const double gamma)
 	{
 		setBary(glm::dvec3(alpha, beta, gamma));
@@ -104,23 +155,8 @@ public:
 	const Material& getMaterial() const;
 
 private:
-	void copyFromOther(const isect& other)
-	{
-		if (this == &other)
-			return ;
-		obj           = other.obj;
-		t             = other.t;
-		N             = other.N;
-		bary          = other.bary;
-		uvCoordinates = other.uvCoordinates;
-		if (other.material) {
-			setMaterial(*other.material);
-		} else {
-			material.reset();
-		}
-	}
-
 	const SceneObject* obj;
+	uint32_t prim;
 	double t;
 	glm::dvec3 N;
 	glm::dvec2 uvCoordinates;
@@ -129,9 +165,7 @@ private:
 	// if this intersection has its own material
 	// (as opposed to one in its associated object)
 	// as in the case where the material was interpolated
-	std::unique_ptr<Material> material;
+	const Material* material;
 };
 
-const double RAY_EPSILON = 0.00000001;
-
 #endif // __RAY_H__
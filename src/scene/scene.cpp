@@ -1,8 +1,11 @@
+#include <chrono>
 #include <cmath>
 
 #include "scene.h"
 #include "light.h"
-#include "kdTree.h"
+#include "accelFactory.h"
+#include "accelReport.h"
+#include "buildTasks.h"
 #include "../ui/TraceUI.h"
 #include <glm/gtx/extended_min_max.hpp>
 #include <iostream>
@@ -22,22 +25,59 @@ bool Geometry::intersect(ray& r, isect& i) const {
 	// Backup World pos/dir, and switch to local pos/dir
 	glm::dvec3 Wpos = r.getPosition();
 	glm::dvec3 Wdir = r.getDirection();
+	double Wtmax = r.getTMax();
 	r.setPosition(pos);
 	r.setDirection(dir);
+	// local distances are measured along the normalized direction
+	r.setTMax(Wtmax * length);
 	bool rtrn = false;
 	if (intersectLocal(r, i))
 	{
-		// Transform the intersection point & normal returned back into global space.
-		i.setN(transform->localToGlobalCoordsNormal(i.getN()));
+		// Transform the intersection point returned back into global space,
+		// the normal waits for completeHit()
 		i.setT(i.getT()/length);
 		rtrn = true;
 	}
-	// Restore World pos/dir
+	// Restore World pos/dir, and the interval shrunk to the hit
 	r.setPosition(Wpos);
 	r.setDirection(Wdir);
+	r.setTMax(rtrn ? std::min(Wtmax, i.getT()) : Wtmax);
 	return rtrn;
 }
 
+void Geometry::completeHit(isect& i) const {
+	completeHitLocal(i);
+	i.setN(transform->localToGlobalCoordsNormal(i.getN()));
+}
+
+bool Geometry::occluded(ray& r) const {
+	if (!isOpaque())
+		return false;
+	double tmin, tmax;
+	if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax))) return false;
+	// Same change of coordinates as in intersect()
+	glm::dvec3 pos = transform->globalToLocalCoords(r.getPosition());
+	glm::dvec3 dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
+	double length = glm::length(dir);
+	dir = glm::normalize(dir);
+	glm::dvec3 Wpos = r.getPosition();
+	glm::dvec3 Wdir = r.getDirection();
+	double Wtmax = r.getTMax();
+	r.setPosition(pos);
+	r.setDirection(dir);
+	r.setTMax(Wtmax * length);
+	bool rtrn = occludedLocal(r);
+	r.setPosition(Wpos);
+	r.setDirection(Wdir);
+	r.setTMax(Wtmax);
+	return rtrn;
+}
+
+bool Geometry::occludedLocal(ray& r) const {
+	isect i;
+	return intersectLocal(r, i);
+}
+
 bool Geometry::hasBoundingBoxCapability() const {
 	// by default, primitives do not have to specify a bounding box.
 	// If this method returns true for a primitive, then either the ComputeBoundingBox() or
@@ -51,13 +91,16 @@ bool Geometry::hasBoundingBoxCapability() const {
 }
 
 void Geometry::ComputeBoundingBox() {
+    localBoundsCache = ComputeLocalBoundingBox();
+    TransformBoundingBox();
+}
+
+void Geometry::TransformBoundingBox() {
     // take the object's local bounding box, transform all 8 points on it,
     // and use those to find a new bounding box.
 
-    BoundingBox localBounds = ComputeLocalBoundingBox();
-        
-    glm::dvec3 min = localBounds.getMin();
-    glm::dvec3 max = localBounds.getMax();
+    glm::dvec3 min = localBoundsCache.getMin();
+    glm::dvec3 max = localBoundsCache.getMax();
 
     glm::dvec4 v, newMax, newMin;
 
@@ -88,6 +131,7 @@ void Geometry::ComputeBoundingBox() {
 		
     bounds.setMax(glm::dvec3(newMax));
     bounds.setMin(glm::dvec3(newMin));
+    boundsRevision = transform->revision();
 }
 
 Scene::Scene()
@@ -100,20 +144,139 @@ Scene::~Scene()
 
 void Scene::buildKdTree()
 {
-	for (auto& obj : objects)
+	// the objects' own trees are independent of each other
+	std::vector<std::future<void>> builds;
+	for (auto& obj : boundedObjects)
+	{
+		Geometry* geometry = obj.get();
+		builds.push_back(build_tasks::spawn([geometry] {
+			geometry->buildKdTree();
+		}));
+	}
+	for (auto& obj : prototypes)
+	{
+		Geometry* geometry = obj.get();
+		builds.push_back(build_tasks::spawn([geometry] {
+			geometry->buildKdTree();
+		}));
+	}
+	for (auto& build : builds)
+		build.get();
+	auto start = std::chrono::steady_clock::now();
+	this->accel = makeAccelerator(this->boundedObjects);
+	accelBuildCost = accel->sahCost();
+	if (accel_report::enabled())
 	{
-		if(obj->hasBoundingBoxCapability())
+		std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+		accel_report::add("scene", boundedObjects.size(), *accel, seconds.count());
+	}
+	translucent = std::any_of(objects.begin(), objects.end(),
+	                          [](const std::shared_ptr<Geometry>& obj) {
+		return !obj->isOpaque();
+	});
+}
+
+// adds the objects of changed not in moved yet
+static void addMoved(std::vector<std::shared_ptr<Geometry>>& moved,
+                     const std::vector<std::shared_ptr<Geometry>>& changed)
+{
+	for (const auto& obj : changed)
+		if (std::find(moved.begin(), moved.end(), obj) == moved.end())
+			moved.push_back(obj);
+}
+
+void Scene::updateTransforms()
+{
+	// only moved objects need new bounds, and none changed shape
+	std::vector<std::shared_ptr<Geometry>> changed;
+	sceneBounds = BoundingBox();
+	for (auto& obj : boundedObjects)
+	{
+		if (obj->boundsStale())
 		{
-			obj->buildKdTree();
+			obj->TransformBoundingBox();
+			changed.push_back(obj);
 		}
+		sceneBounds.merge(obj->getBoundingBox());
+	}
+	if (!accel)
+		return;
+	// a rebuild still running started from the bounds before these moves
+	if (accelRebuild.valid())
+		addMoved(movedSinceRebuild, changed);
+	// a swapped in rebuild is already up to date with the bounds above
+	if (!pollRebuild() && !accel->refit())
+	{
+		addMoved(movedObjects, changed);
+		startRebuild();
+		return;
 	}
-	this->kdtree = std::make_unique<KdTree<std::shared_ptr<Geometry>>>(this->objects, 0);
+	double threshold = traceUI->getRebuildThreshold();
+	if (threshold > 0.0 && accel->sahCost() > threshold * accelBuildCost)
+		startRebuild();
+}
+
+void Scene::startRebuild()
+{
+	// objects moving meanwhile are collected in movedSinceRebuild, and
+	// get another rebuild once this one is in
+	if (accelRebuild.valid())
+		return;
+	// The build gets its own copy of the objects and their bounds, so the
+	// updates that follow can go on changing them meanwhile.
+	auto objs = boundedObjects;
+	auto bounds = objectBounds(boundedObjects);
+	movedSinceRebuild.clear();
+	accelRebuild = std::async(std::launch::async, [objs, bounds]() mutable {
+		return makeAccelerator(objs, bounds);
+	});
+}
+
+bool Scene::pollRebuild()
+{
+	if (!accelRebuild.valid() ||
+	    accelRebuild.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		return false;
+	accel = accelRebuild.get();
+	// its cost as built, from the bounds the rebuild started with
+	accelBuildCost = accel->sahCost();
+	if (accel->refit())
+		movedObjects.clear();
+	else
+		movedObjects = std::move(movedSinceRebuild);
+	movedSinceRebuild.clear();
+	if (!movedObjects.empty())
+		startRebuild();
+	return true;
+}
+
+AccelStats Scene::accelStats() const
+{
+	AccelStats stats;
+	if (accel)
+		stats = accel->stats();
+	for (const auto& obj : objects)
+		obj->addAccelStats(stats);
+	for (const auto& obj : prototypes)
+		obj->addAccelStats(stats);
+	return stats;
 }
 
 void Scene::add(Geometry* obj) {
-	obj->ComputeBoundingBox();
-	sceneBounds.merge(obj->getBoundingBox());
 	objects.emplace_back(obj);
+	if (obj->hasBoundingBoxCapability()) {
+		obj->ComputeBoundingBox();
+		sceneBounds.merge(obj->getBoundingBox());
+		boundedObjects.push_back(objects.back());
+	} else {
+		unboundedObjects.push_back(objects.back());
+	}
+}
+
+void Scene::addPrototype(Geometry* obj) {
+	// instances take their local bounds from it
+	obj->ComputeBoundingBox();
+	prototypes.emplace_back(obj);
 }
 
 void Scene::add(Light* light)
@@ -131,7 +294,25 @@ bool Scene::intersect(ray& r, isect& i) const {
 	bool have_one = false;
 	if(traceUI->kdSwitch())
 	{
-		kdtree->intersect(r, i, have_one);
+		accel->intersect(r, i, have_one);
+		for(const auto& obj : unboundedObjects) {
+			isect cur;
+			if( obj->intersect(r, cur) ) {
+				if(!have_one || (cur.getT() < i.getT())) {
+					i = cur;
+					have_one = true;
+				}
+			}
+		}
+		for(const auto& obj : movedObjects) {
+			isect cur;
+			if( obj->intersect(r, cur) ) {
+				if(!have_one || (cur.getT() < i.getT())) {
+					i = cur;
+					have_one = true;
+				}
+			}
+		}
 	}
 	else
 	{
@@ -145,7 +326,9 @@ bool Scene::intersect(ray& r, isect& i) const {
 			}
 		}
 	}
-	if(!have_one)
+	if(have_one)
+		i.getObject()->completeHit(i);
+	else
 		i.setT(1000.0);
 	// if debugging,
 	if (TraceUI::m_debug)
@@ -153,6 +336,32 @@ bool Scene::intersect(ray& r, isect& i) const {
 	return have_one;
 }
 
+bool Scene::occluded(ray& r, double maxDist) const {
+	double tmax = r.getTMax();
+	r.setTMax(std::min(tmax, maxDist));
+	bool blocked = false;
+	if(traceUI->kdSwitch())
+	{
+		auto occludes = [&r](const std::shared_ptr<Geometry>& obj) {
+			return obj->occluded(r);
+		};
+		blocked = accel->occluded(r) ||
+		          std::any_of(unboundedObjects.begin(), unboundedObjects.end(), occludes) ||
+		          std::any_of(movedObjects.begin(), movedObjects.end(), occludes);
+	}
+	else
+	{
+		for(const auto& obj : objects) {
+			if( obj->occluded(r) ) {
+				blocked = true;
+				break;
+			}
+		}
+	}
+	r.setTMax(tmax);
+	return blocked;
+}
+
 TextureMap* Scene::getTexture(string name) {
 	auto itr = textureCache.find(name);
 	if (itr == textureCache.end()) {
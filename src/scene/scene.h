@@ -10,6 +10,8 @@
 #define __SCENE_H__
 
 #include <algorithm>
+#include <cstdint>
+#include <future>
 #include <map>
 #include <memory>
 #include <string>
@@ -33,7 +35,8 @@ class Light;
 class Scene;
 
 template <typename Obj>
-class KdTree;
+class Accelerator;
+struct AccelStats;
 
 class SceneElement {
 public:
@@ -71,6 +74,21 @@ protected:
 	TransformNode* parent;
 	std::vector<TransformNode*> children;
 
+	// this node's own part of xform
+	glm::dmat4x4 local;
+	// counts the changes to xform
+	uint64_t rev = 0;
+
+	void update()
+	{
+		rev++;
+		xform = parent ? parent->xform * local : local;
+		inverse = glm::inverse(xform);
+		normi = glm::transpose(glm::inverse(glm::dmat3x3(xform)));
+		for (auto c : children)
+			c->update();
+	}
+
 public:
 	typedef std::vector<TransformNode*>::iterator child_iter;
 	typedef std::vector<TransformNode*>::const_iterator child_citer;
@@ -110,21 +128,28 @@ public:
 	}
 
 	const glm::dmat4x4& transform() const { return xform; }
+	// changes whenever xform does, also through a parent
+	uint64_t revision() const { return rev; }
+
+	// Replaces the transformation of this node relative to its parent.
+	// Everything below it moves along; call Scene::updateTransforms()
+	// afterwards.
+	void setLocalTransform(const glm::dmat4x4& m)
+	{
+		local = m;
+		update();
+	}
+	const glm::dmat4x4& localTransform() const { return local; }
 
 protected:
 	// protected so that users can't directly construct one of these...
 	// force them to use the createChild() method.  Note that they CAN
 	// directly create a TransformRoot object.
 	TransformNode(TransformNode* parent, const glm::dmat4x4& xform)
-	        : children()
+	        : children(), local(xform)
 	{
 		this->parent = parent;
-		if (parent == NULL)
-			this->xform = xform;
-		else
-			this->xform = parent->xform * xform;
-		inverse = glm::inverse(this->xform);
-		normi = glm::transpose(glm::inverse(glm::dmat3x3(this->xform)));
+		update();
 	}
 };
 
@@ -141,19 +166,57 @@ protected:
 	// intersections performed in the object's local coordinate space
 	// do not call directly - this should only be called by intersect()
 	virtual bool intersectLocal(ray& r, isect& i) const = 0;
+	// the local part of occluded().  The default goes through
+	// intersectLocal(), objects override it to skip computing the normal,
+	// material and so on.
+	virtual bool occludedLocal(ray& r) const;
+	// the local part of completeHit(): whatever intersectLocal() left out
+	// of the hit.  The default leaves it as it is.
+	virtual void completeHitLocal(isect& i) const {}
 
 public:
-	// intersections performed in the global coordinate space.
+	// intersections performed in the global coordinate space.  The normal
+	// is left in the object's space, and objects may leave out more, see
+	// completeHit().
 	bool intersect(ray& r, isect& i) const;
+	// Fills in the rest of a hit found by intersect() and brings the
+	// normal to global space.  Most candidate hits are discarded for a
+	// closer one, so this is only done for the hit that is kept.
+	void completeHit(isect& i) const;
+	// True if the object is opaque and r hits it within (RAY_EPSILON,
+	// tmax].  This is all a shadow ray needs to know.
+	bool occluded(ray& r) const;
+	// false if the object may let light through
+	virtual bool isOpaque() const { return false; }
 
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
+	// Perfect splits: lo and hi come in as the bounding box cut down to
+	// region, and are narrowed to the part of the object that actually
+	// lies in it.  Returns false if none does.  The default keeps the box.
+	virtual bool clipBounds(const BoundingBox& region, glm::dvec3& lo,
+	                        glm::dvec3& hi) const
+	{
+		return true;
+	}
 	glm::dvec3 getNormal() { return glm::dvec3(1.0, 0.0, 0.0); }
 
 	virtual void buildKdTree() {}
+	// adds the size of this object's own acceleration structure, if it
+	// has one
+	virtual void addAccelStats(AccelStats& stats) const {}
 	virtual bool isTrimesh() { return true; }
 
 	virtual void ComputeBoundingBox();
+	// Brings the bounds up to date with the transform, reusing the local
+	// bounds of the last ComputeBoundingBox(); for objects that moved
+	// without changing shape.
+	void TransformBoundingBox();
+	// true if the transform changed since the bounds were computed
+	bool boundsStale() const
+	{
+		return transform->revision() != boundsRevision;
+	}
 
 	// default method for ComputeLocalBoundingBox returns a bogus bounding
 	// box;
@@ -164,6 +227,7 @@ public:
 	{
 		this->transform = transform;
 	};
+	TransformNode* getTransform() const { return transform; }
 
 	Geometry(Scene* scene) : SceneElement(scene) {}
 
@@ -182,6 +246,10 @@ public:
 protected:
 	BoundingBox bounds;
 	TransformNode* transform;
+	// ComputeLocalBoundingBox() as of the last ComputeBoundingBox()
+	BoundingBox localBoundsCache;
+	// transform->revision() that bounds were computed for
+	uint64_t boundsRevision = 0;
 };
 
 // A SceneObject is a real actual thing that we want to model in the
@@ -192,6 +260,7 @@ class SceneObject : public Geometry {
 public:
 	virtual const Material& getMaterial() const = 0;
 	virtual void setMaterial(Material* m) = 0;
+	virtual bool isOpaque() const { return !getMaterial().Trans(); }
 
 	void glDraw(int quality, bool actualMaterials,
 	            bool actualTextures) const;
@@ -231,9 +300,18 @@ public:
 	virtual ~Scene();
 
 	void add(Geometry* obj);
+	// Keeps obj, and builds its acceleration structure with the scene's,
+	// without placing it: it is only seen through instances of it.
+	void addPrototype(Geometry* obj);
 	void add(Light* light);
 
 	bool intersect(ray& r, isect& i) const;
+	// True if an opaque object blocks r within maxDist.  Unlike intersect()
+	// it stops at the first such object found.
+	bool occluded(ray& r, double maxDist) const;
+	// true if some object may let light through, so shadow rays also have
+	// to look at what they pass through
+	bool hasTranslucent() const { return translucent; }
 
 	auto beginLights() const { return lights.begin(); }
 	auto endLights() const { return lights.end(); }
@@ -267,9 +345,38 @@ public:
 	const BoundingBox& bounds() const { return sceneBounds; }
 
 	void buildKdTree();
+	// Brings the bounds of all objects, and the acceleration structure over
+	// them, up to date after transforms were changed.  The structure is
+	// refit in place if it supports that.  Otherwise the moved objects are
+	// tested one by one next to it, and a rebuild starts in the background
+	// on the bounds as they are then.  A refit structure is rebuilt the
+	// same way once refitting has made it "rebuild_threshold" times more
+	// expensive than when it was built.  Must not be called while
+	// rendering.
+	void updateTransforms();
+	// Swaps in the background rebuild if it is done, up to date with the
+	// current bounds, and returns true if it did.  Never waits for the
+	// rebuild.  Must not be called while rendering.
+	bool pollRebuild();
+	// combined size of the scene acceleration structure and those of all
+	// objects, with the type of the scene's
+	AccelStats accelStats() const;
 private:
 	std::vector<std::unique_ptr<Light>> lights;
 	std::vector<std::shared_ptr<Geometry>> objects;
+	// objects split by hasBoundingBoxCapability().  Only the bounded ones
+	// go into accel; a box made up for the others would stretch its root
+	// and every split, so they are tested one by one next to it.
+	std::vector<std::shared_ptr<Geometry>> boundedObjects;
+	std::vector<std::shared_ptr<Geometry>> unboundedObjects;
+	// see addPrototype()
+	std::vector<std::unique_ptr<Geometry>> prototypes;
+	// Bounded objects that moved since accel was built, when it cannot be
+	// refit.  It only finds them where they were, so they are also tested
+	// one by one until a rebuild replaces it.
+	std::vector<std::shared_ptr<Geometry>> movedObjects;
+	// the objects that moved since the running rebuild started
+	std::vector<std::shared_ptr<Geometry>> movedSinceRebuild;
 	Camera camera;
 
 	// This is the total amount of ambient light in the scene
@@ -286,7 +393,14 @@ private:
 	// are exempt from this requirement.
 	BoundingBox sceneBounds;
 
-	std::unique_ptr<KdTree<std::shared_ptr<Geometry>>> kdtree;
+	std::unique_ptr<Accelerator<std::shared_ptr<Geometry>>> accel;
+	// sahCost() of accel when it was built
+	double accelBuildCost = 0.0;
+	bool translucent = true;
+	// Starts a rebuild in the background unless one is running already
+	void startRebuild();
+	// background rebuild started by updateTransforms(), if any
+	std::future<std::unique_ptr<Accelerator<std::shared_ptr<Geometry>>>> accelRebuild;
 
 public:
 	// This is used for debugging purposes only.
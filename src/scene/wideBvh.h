@@ -0,0 +1,508 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "accelerator.h"
+#include "bvh.h"
+#include "ray.h"
+
+// Four wide BVH, collapsed from the binary one.  The bounds of the children
+// of a node are stored component by component, so a ray tests all four with
+// one AVX (or two SSE2) slab tests.  Four lanes of doubles fill exactly one
+// AVX register.
+namespace wide_bvh {
+const int kWidth = 4;
+
+// children's planes as doubles, from either precision of node bounds
+#if defined(__AVX__)
+inline __m256d load4(const double* p) { return _mm256_loadu_pd(p); }
+inline __m256d load4(const float* p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+#elif defined(__SSE2__)
+inline __m128d load2(const double* p) { return _mm_loadu_pd(p); }
+inline __m128d load2(const float* p) { return _mm_set_pd(p[1], p[0]); }
+#endif
+}
+
+template <class T>
+class WideBvh : public Accelerator<T>
+{
+private:
+	typedef typename AccelScalar<T>::type Real;
+	static const uint32_t kEmpty = 0xffffffff;
+	// 224 bytes per node, or 128 with float bounds.  Unused slots have
+	// inverted, infinite bounds that no ray can hit.
+	struct Node
+	{
+		Real bmin[3][wide_bvh::kWidth];
+		Real bmax[3][wide_bvh::kWidth];
+		// index of an interior child, or first entry in _primIndices of
+		// a leaf child
+		uint32_t child[wide_bvh::kWidth];
+		// objects in a leaf child, 0 for interior children
+		uint32_t count[wide_bvh::kWidth];
+	};
+	typedef typename Bvh<T>::Node BinaryNode;
+
+	std::vector<Node> _nodes;
+	// leaf contents, as indices into _prims
+	std::vector<uint32_t> _primIndices;
+	std::vector<T> _prims;
+
+	uint32_t collapse(const std::vector<BinaryNode>& binary, uint32_t node);
+	static int intersectChildren(const Node& node, const double org[3],
+	                             const double invDir[3],
+	                             const bool dirNeg[3], double tmax,
+	                             double tnear[wide_bvh::kWidth]);
+	bool valid() const;
+	template <class Visit>
+	bool traverse(ray& r, Visit visit) const;
+public:
+	WideBvh(std::vector<T>& objects);
+	WideBvh(std::vector<T>& objects, const std::vector<BoundingBox>& bounds);
+	WideBvh(std::vector<T>& objects, AccelReader& in);
+	bool intersect(ray& r, isect& i, bool& have_one) const override;
+	bool occluded(ray& r) const override;
+	AccelStats stats() const override;
+	bool refit() override;
+	double sahCost() const override;
+	void save(AccelWriter& out) const override;
+};
+
+template <class T>
+WideBvh<T>::WideBvh(std::vector<T>& objects) :
+   WideBvh(objects, objectBounds(objects)) {}
+
+template <class T>
+WideBvh<T>::WideBvh(std::vector<T>& objects,
+                    const std::vector<BoundingBox>& bounds)
+{
+	Bvh<T> binary(objects, bounds);
+	_primIndices = std::move(binary._primIndices);
+	_prims = std::move(binary._prims);
+	if (!binary._nodes.empty())
+	{
+		_nodes.reserve(binary._nodes.size() / 2 + 1);
+		collapse(binary._nodes, 0);
+		_nodes.shrink_to_fit();
+	}
+}
+
+template <class T>
+WideBvh<T>::WideBvh(std::vector<T>& objects, AccelReader& in) :
+   _nodes(),
+   _primIndices(),
+   _prims(objects)
+{
+	in.read(_nodes);
+	in.read(_primIndices);
+	if (!in.ok || !valid())
+	{
+		in.ok = false;
+		_nodes.clear();
+		_primIndices.clear();
+	}
+}
+
+template <class T>
+void WideBvh<T>::save(AccelWriter& out) const
+{
+	out.write(_nodes);
+	out.write(_primIndices);
+}
+
+// Checks a tree read from the cache, see KdTree::valid()
+template <class T>
+bool WideBvh<T>::valid() const
+{
+	std::vector<int> depth(_nodes.size(), 1);
+	for (uint32_t k = 0; k < _nodes.size(); k++)
+	{
+		const Node& node = _nodes[k];
+		if (depth[k] > bvh_sah::kMaxDepth)
+			return false;
+		for (int c = 0; c < wide_bvh::kWidth; c++)
+		{
+			uint32_t child = node.child[c];
+			if (child == kEmpty)
+				continue;
+			if (node.count[c] > 0)
+			{
+				if (child > _primIndices.size() ||
+				    node.count[c] > _primIndices.size() - child)
+					return false;
+				continue;
+			}
+			if (child <= k || child >= _nodes.size())
+				return false;
+			depth[child] = depth[k] + 1;
+		}
+	}
+	for (uint32_t p : _primIndices)
+		if (p >= _prims.size())
+			return false;
+	return true;
+}
+
+// Emits the wide node for binary node `node` and everything below it.  Its
+// children are found by repeatedly opening the interior child with the
+// largest surface area until there are kWidth of them.
+template <class T>
+uint32_t WideBvh<T>::collapse(const std::vector<BinaryNode>& binary,
+                              uint32_t node)
+{
+	using wide_bvh::kWidth;
+	const double inf = std::numeric_limits<double>::infinity();
+	uint32_t slots[kWidth];
+	int nSlots = 0;
+	if (binary[node].isLeaf())
+		slots[nSlots++] = node;
+	else
+	{
+		slots[nSlots++] = node + 1;
+		slots[nSlots++] = binary[node].offset;
+	}
+	while (nSlots < kWidth)
+	{
+		int open = -1;
+		double openArea = -1.0;
+		for (int k = 0; k < nSlots; k++)
+		{
+			const BinaryNode& b = binary[slots[k]];
+			if (b.isLeaf())
+				continue;
+			double area = Bvh<T>::halfArea(b.lo(), b.hi());
+			if (area > openArea)
+			{
+				open = k;
+				openArea = area;
+			}
+		}
+		if (open < 0)
+			break;
+		uint32_t opened = slots[open];
+		slots[open] = opened + 1;
+		slots[nSlots++] = binary[opened].offset;
+	}
+
+	uint32_t index = _nodes.size();
+	_nodes.emplace_back();
+	for (int k = 0; k < kWidth; k++)
+	{
+		Node& wide = _nodes[index];
+		if (k >= nSlots)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				wide.bmin[axis][k] = inf;
+				wide.bmax[axis][k] = -inf;
+			}
+			wide.child[k] = kEmpty;
+			wide.count[k] = 0;
+			continue;
+		}
+		const BinaryNode& b = binary[slots[k]];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			wide.bmin[axis][k] = b.bmin[axis];
+			wide.bmax[axis][k] = b.bmax[axis];
+		}
+		wide.count[k] = b.count;
+		wide.child[k] = b.offset;
+	}
+	// _nodes may grow below, so only index it from here on
+	for (int k = 0; k < nSlots; k++)
+	{
+		if (binary[slots[k]].isLeaf())
+			continue;
+		uint32_t child = collapse(binary, slots[k]);
+		_nodes[index].child[k] = child;
+	}
+	return index;
+}
+
+// Slab test of the ray against all children of node at once.  Only the near
+// plane of each slab is needed for the entry distance, so the planes are
+// picked by the direction signs up front instead of taking min and max of
+// every lane.  Returns a bit mask of the children hit within [0, tmax] and
+// their entry distances in tnear.
+template <class T>
+int WideBvh<T>::intersectChildren(const Node& node, const double org[3],
+                                  const double invDir[3],
+                                  const bool dirNeg[3], double tmax,
+                                  double tnear[wide_bvh::kWidth])
+{
+#if defined(__AVX__)
+	__m256d tmin4 = _mm256_setzero_pd();
+	__m256d tmax4 = _mm256_set1_pd(tmax);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const Real* nearPlane = dirNeg[axis] ? node.bmax[axis] : node.bmin[axis];
+		const Real* farPlane = dirNeg[axis] ? node.bmin[axis] : node.bmax[axis];
+		__m256d o = _mm256_set1_pd(org[axis]);
+		__m256d inv = _mm256_set1_pd(invDir[axis]);
+		__m256d t0 = _mm256_mul_pd(_mm256_sub_pd(wide_bvh::load4(nearPlane), o), inv);
+		__m256d t1 = _mm256_mul_pd(_mm256_sub_pd(wide_bvh::load4(farPlane), o), inv);
+		tmin4 = _mm256_max_pd(tmin4, t0);
+		tmax4 = _mm256_min_pd(tmax4, t1);
+	}
+	_mm256_storeu_pd(tnear, tmin4);
+	tmax4 = _mm256_add_pd(tmax4, _mm256_set1_pd(RAY_EPSILON));
+	return _mm256_movemask_pd(_mm256_cmp_pd(tmin4, tmax4, _CMP_LE_OQ));
+#elif defined(__SSE2__)
+	int mask = 0;
+	for (int half = 0; half < wide_bvh::kWidth; half += 2)
+	{
+		__m128d tmin2 = _mm_setzero_pd();
+		__m128d tmax2 = _mm_set1_pd(tmax);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const Real* nearPlane = dirNeg[axis] ? node.bmax[axis] : node.bmin[axis];
+			const Real* farPlane = dirNeg[axis] ? node.bmin[axis] : node.bmax[axis];
+			__m128d o = _mm_set1_pd(org[axis]);
+			__m128d inv = _mm_set1_pd(invDir[axis]);
+			__m128d t0 = _mm_mul_pd(_mm_sub_pd(wide_bvh::load2(nearPlane + half), o), inv);
+			__m128d t1 = _mm_mul_pd(_mm_sub_pd(wide_bvh::load2(farPlane + half), o), inv);
+			tmin2 = _mm_max_pd(tmin2, t0);
+			tmax2 = _mm_min_pd(tmax2, t1);
+		}
+		_mm_storeu_pd(tnear + half, tmin2);
+		tmax2 = _mm_add_pd(tmax2, _mm_set1_pd(RAY_EPSILON));
+		mask |= _mm_movemask_pd(_mm_cmple_pd(tmin2, tmax2)) << half;
+	}
+	return mask;
+#else
+	int mask = 0;
+	for (int k = 0; k < wide_bvh::kWidth; k++)
+	{
+		double tmin = 0.0;
+		double tfar = tmax;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			double nearPlane = dirNeg[axis] ? node.bmax[axis][k] : node.bmin[axis][k];
+			double farPlane = dirNeg[axis] ? node.bmin[axis][k] : node.bmax[axis][k];
+			tmin = std::max(tmin, (nearPlane - org[axis]) * invDir[axis]);
+			tfar = std::min(tfar, (farPlane - org[axis]) * invDir[axis]);
+		}
+		tnear[k] = tmin;
+		if (tmin <= tfar + RAY_EPSILON)
+			mask |= 1 << k;
+	}
+	return mask;
+#endif
+}
+
+// Depth first traversal.  The children that are hit are pushed far to near,
+// and entries are dropped when popped if they start behind the ray's tmax.
+// visit(k) is called for the objects in the leaves that are reached and
+// returns true to end the traversal early.
+template <class T>
+template <class Visit>
+bool WideBvh<T>::traverse(ray& r, Visit visit) const
+{
+	using wide_bvh::kWidth;
+	if (_nodes.empty())
+		return false;
+
+	const glm::dvec3 pos = r.getPosition();
+	const glm::dvec3& inv = r.getInverseDirection();
+	double org[3], invDir[3];
+	bool dirNeg[3];
+	for (int k = 0; k < 3; k++)
+	{
+		org[k] = pos[k];
+		invDir[k] = inv[k];
+		dirNeg[k] = r.getSign(k);
+	}
+
+	struct StackEntry
+	{
+		uint32_t index;
+		uint32_t count; // 0 for an interior node
+		double tnear;
+	};
+	// every node pushes at most kWidth entries and pops one
+	StackEntry stack[(kWidth - 1) * bvh_sah::kMaxDepth + 1];
+	int top = 0;
+	stack[top++] = {0, 0, 0.0};
+	while (top > 0)
+	{
+		const StackEntry entry = stack[--top];
+		if (entry.tnear > r.getTMax())
+			continue;
+		if (entry.count > 0)
+		{
+			const uint32_t* prim = _primIndices.data() + entry.index;
+			for (uint32_t k = 0; k < entry.count; k++)
+				if (visit(prim[k]))
+					return true;
+			continue;
+		}
+
+		const Node& node = _nodes[entry.index];
+		double tnear[kWidth];
+		int mask = intersectChildren(node, org, invDir, dirNeg, r.getTMax(), tnear);
+		// insertion sort of the hit children, furthest first
+		int order[kWidth];
+		int nHit = 0;
+		for (int k = 0; k < kWidth; k++)
+		{
+			if (!(mask & (1 << k)))
+				continue;
+			int slot = nHit++;
+			while (slot > 0 && tnear[order[slot - 1]] < tnear[k])
+			{
+				order[slot] = order[slot - 1];
+				slot--;
+			}
+			order[slot] = k;
+		}
+		for (int k = 0; k < nHit; k++)
+		{
+			int c = order[k];
+			stack[top++] = {node.child[c], node.count[c], tnear[c]};
+		}
+	}
+	return false;
+}
+
+template <class T>
+bool WideBvh<T>::intersect(ray& r, isect& i, bool& have_one) const
+{
+	isect check_intersect;
+	traverse(r, [&](uint32_t k) {
+		if(_prims[k]->intersect(r, check_intersect))
+		{
+			// Take the earliest time of intersection
+			if (!have_one || check_intersect.getT() < i.getT())
+			{
+				i = check_intersect;
+				have_one = true;
+			}
+		}
+		return false;
+	});
+	return have_one;
+}
+
+template <class T>
+bool WideBvh<T>::occluded(ray& r) const
+{
+	return traverse(r, [&](uint32_t k) { return _prims[k]->occluded(r); });
+}
+
+// Same sweep as Bvh::refit().  The box of an interior child is the union of
+// its own children's, and the inverted bounds of unused slots drop out of
+// that union by themselves.
+template <class T>
+bool WideBvh<T>::refit()
+{
+	using wide_bvh::kWidth;
+	const double inf = std::numeric_limits<double>::infinity();
+	for (uint32_t k = _nodes.size(); k-- > 0;)
+	{
+		Node& node = _nodes[k];
+		for (int c = 0; c < kWidth; c++)
+		{
+			if (node.child[c] == kEmpty)
+				continue;
+			glm::dvec3 bmin(inf), bmax(-inf);
+			if (node.count[c] > 0)
+			{
+				const uint32_t* prim = _primIndices.data() + node.child[c];
+				for (uint32_t j = 0; j < node.count[c]; j++)
+				{
+					const BoundingBox& b = _prims[prim[j]]->getBoundingBox();
+					bmin = glm::min(bmin, b.getMin());
+					bmax = glm::max(bmax, b.getMax());
+				}
+			}
+			else
+			{
+				const Node& child = _nodes[node.child[c]];
+				for (int axis = 0; axis < 3; axis++)
+					for (int j = 0; j < kWidth; j++)
+					{
+						bmin[axis] = std::min(bmin[axis], double(child.bmin[axis][j]));
+						bmax[axis] = std::max(bmax[axis], double(child.bmax[axis][j]));
+					}
+			}
+			for (int axis = 0; axis < 3; axis++)
+			{
+				node.bmin[axis][c] = roundDown<Real>(bmin[axis]);
+				node.bmax[axis][c] = roundUp<Real>(bmax[axis]);
+			}
+		}
+	}
+	return true;
+}
+
+template <class T>
+double WideBvh<T>::sahCost() const
+{
+	using wide_bvh::kWidth;
+	if (_nodes.empty())
+		return 0.0;
+	const double inf = std::numeric_limits<double>::infinity();
+	glm::dvec3 rmin(inf), rmax(-inf);
+	double cost = 0.0;
+	for (uint32_t k = 0; k < _nodes.size(); k++)
+	{
+		const Node& node = _nodes[k];
+		for (int c = 0; c < kWidth; c++)
+		{
+			if (node.child[c] == kEmpty)
+				continue;
+			glm::dvec3 bmin(node.bmin[0][c], node.bmin[1][c], node.bmin[2][c]);
+			glm::dvec3 bmax(node.bmax[0][c], node.bmax[1][c], node.bmax[2][c]);
+			if (k == 0)
+			{
+				rmin = glm::min(rmin, bmin);
+				rmax = glm::max(rmax, bmax);
+			}
+			double area = Bvh<T>::halfArea(bmin, bmax);
+			cost += area * (node.count[c] > 0 ? node.count[c]
+			                                  : bvh_sah::kTraversalCost);
+		}
+	}
+	double rootArea = Bvh<T>::halfArea(rmin, rmax);
+	return rootArea > 0.0 ? cost / rootArea : 0.0;
+}
+
+template <class T>
+AccelStats WideBvh<T>::stats() const
+{
+	AccelStats s;
+	s.type = ACCEL_BVH4;
+	s.nodes = _nodes.size();
+	std::vector<std::pair<uint32_t, int>> stack;
+	if (!_nodes.empty())
+		stack.emplace_back(0, 0);
+	while (!stack.empty())
+	{
+		const Node& node = _nodes[stack.back().first];
+		int depth = stack.back().second;
+		stack.pop_back();
+		for (int c = 0; c < wide_bvh::kWidth; c++)
+		{
+			if (node.child[c] == kEmpty)
+				continue;
+			if (node.count[c] > 0)
+				s.addLeaf(depth + 1, node.count[c]);
+			else
+				stack.emplace_back(node.child[c], depth + 1);
+		}
+	}
+	s.references = _primIndices.size();
+	s.bytes = sizeof(*this) + _nodes.capacity() * sizeof(Node) +
+	          _primIndices.capacity() * sizeof(uint32_t) +
+	          _prims.capacity() * sizeof(T);
+	return s;
+}
@@ -10,14 +10,28 @@ extern int getopt(int argc, char** argv, const char* optstring);
 #endif
 
 #include <assert.h>
+#include <chrono>
+#include <cstdio>
+
+#include <glm/gtc/matrix_transform.hpp>
 
 #include "../fileio/images.h"
 #include "CommandLineUI.h"
 
 #include "../RayTracer.h"
+#include "../allocCounter.h"
+#include "../scene/scene.h"
+#include "../scene/accelerator.h"
+#include "../scene/accelReport.h"
+#include "../SceneObjects/triangleBlock.h"
 
 using namespace std;
 
+namespace {
+// updates an object move (-m) is split into
+const int kMoveSteps = 8;
+}
+
 // The command line UI simply parses out all the arguments off
 // the command line and stores them locally.
 CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
@@ -25,8 +39,10 @@ CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
 	int i;
 	progName = argv[0];
 	const char* jsonfile = nullptr;
+	const char* accelName = nullptr;
+	const char* accelCache = nullptr;
 	string cubemap_file;
-	while ((i = getopt(argc, argv, "t:r:w:hj:c:k:a:d:s")) != EOF) {
+	while ((i = getopt(argc, argv, "t:r:w:hj:c:k:a:d:sbA:C:R:m:")) != EOF) {
 		switch (i) {
 			case 't':
 				m_threads = std::min((unsigned)stoi(optarg), std::thread::hardware_concurrency());
@@ -60,6 +76,28 @@ CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
 			case 's':
 				m_sird = true;
 				break;
+			case 'b':
+				m_benchmark = true;
+				break;
+			case 'A':
+				accelName = optarg;
+				break;
+			case 'C':
+				accelCache = optarg;
+				break;
+			case 'R':
+				m_accelReport = optarg;
+				break;
+			case 'm':
+				if (sscanf(optarg, "%d,%lf,%lf,%lf", &m_moveObject,
+				           &m_moveBy[0], &m_moveBy[1], &m_moveBy[2]) != 4 ||
+				    m_moveObject < 0) {
+					std::cerr << "Bad object move '" << optarg << "'."
+					          << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
 			case 'h':
 				usage();
 				exit(1);
@@ -74,6 +112,16 @@ CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
 	if (jsonfile) {
 		loadFromJson(jsonfile);
 	}
+	// the command line overrides the JSON file
+	if (accelName && !setAccelerator(accelName)) {
+		std::cerr << "Unknown accelerator '" << accelName << "'."
+		          << std::endl;
+		usage();
+		exit(1);
+	}
+	if (accelCache) {
+		m_accelCache = accelCache;
+	}
 	if (!cubemap_file.empty()) {
 		smartLoadCubemap(cubemap_file);
 	}
@@ -90,7 +138,21 @@ CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
 int CommandLineUI::run()
 {
 	assert(raytracer != 0);
+	auto loadStart = std::chrono::steady_clock::now();
+	accel_report::clear();
 	raytracer->loadScene(rayName);
+	std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - loadStart;
+	if (raytracer->sceneLoaded() && !m_accelReport.empty())
+		accel_report::write(m_accelReport);
+	double moveTime = 0.0;
+	if (raytracer->sceneLoaded() && m_moveObject >= 0) {
+		moveTime = moveObject();
+		if (moveTime < 0.0) {
+			std::cerr << "No object " << m_moveObject << " to move."
+			          << std::endl;
+			return 1;
+		}
+	}
 
 	if (raytracer->sceneLoaded()) {
 		int width = m_nSize;
@@ -100,6 +162,9 @@ int CommandLineUI::run()
 
 		clock_t start, end;
 		start = clock();
+		TraceUI::resetCount();
+		std::size_t allocStart = alloc_counter::count();
+		auto traceStart = std::chrono::steady_clock::now();
 
 		raytracer->traceImage(width, height);
 		raytracer->waitRender();
@@ -113,6 +178,8 @@ int CommandLineUI::run()
 		}
 
 		end = clock();
+		std::chrono::duration<double> traceTime = std::chrono::steady_clock::now() - traceStart;
+		std::size_t allocations = alloc_counter::count() - allocStart;
 
 		// save image
 		unsigned char* buf;
@@ -126,6 +193,33 @@ int CommandLineUI::run()
 		//		int totalRays = TraceUI::resetCount();
 		//		std::cout << "total time = " << t << " seconds,
 		// rays traced = " << totalRays << std::endl;
+		if (m_benchmark) {
+			int totalRays = TraceUI::resetCount();
+			AccelStats accel = raytracer->getScene().accelStats();
+			std::cout << "load:    " << loadTime.count() << " s" << std::endl;
+			if (m_moveObject >= 0)
+				std::cout << "move:    " << moveTime << " s for "
+				          << kMoveSteps << " updates" << std::endl;
+			std::cout << "trace:   " << traceTime.count() << " s, "
+			          << totalRays << " rays, "
+			          << totalRays / traceTime.count() * 1e-6 << " Mrays/s" << std::endl
+			          << "alloc:   ";
+			if (alloc_counter::available())
+				std::cout << allocations << " allocations during the trace" << std::endl;
+			else
+				std::cout << "not counted (build with RAY_COUNT_ALLOCS)" << std::endl;
+			std::cout << "accel:   " << acceleratorName(accel.type) << ", "
+			          << accel.nodes << " nodes, "
+			          << accel.leaves << " leaves, "
+			          << accel.references << " references, "
+			          << accel.bytes / 1024 << " KB" << std::endl;
+			if (accel.faces > 0)
+				std::cout << "mesh:    " << accel.faces << " faces, "
+				          << accel.meshBytes / 1024 << " KB, "
+				          << (accel.meshBytes + accel.bytes) / accel.faces
+				          << " bytes per face with the structures" << std::endl;
+			benchmarkTriangleTests(std::cout);
+		}
 		return 0;
 	} else {
 		std::cerr << "Unable to load ray file '" << rayName << "'"
@@ -134,6 +228,31 @@ int CommandLineUI::run()
 	}
 }
 
+// Moves the object in kMoveSteps equal steps, bringing the scene up to
+// date after each one as dragging it in an editor would.  This goes
+// through the refits and rebuilds of Scene::updateTransforms(), and the
+// image should match that of the scene loaded with the object already
+// moved.  Returns the time the updates took, or -1 if there is no such
+// object.
+double CommandLineUI::moveObject()
+{
+	Scene& scene = raytracer->getScene();
+	auto obj = scene.beginObjects();
+	for (int k = 0; k < m_moveObject && obj != scene.endObjects(); k++)
+		++obj;
+	if (obj == scene.endObjects())
+		return -1.0;
+	TransformNode* node = (*obj)->getTransform();
+	glm::dmat4x4 step = glm::translate(glm::dmat4x4(1.0), m_moveBy / double(kMoveSteps));
+	auto start = std::chrono::steady_clock::now();
+	for (int k = 0; k < kMoveSteps; k++) {
+		node->setLocalTransform(step * node->localTransform());
+		scene.updateTransforms();
+	}
+	std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+	return seconds.count();
+}
+
 void CommandLineUI::alert(const string& msg)
 {
 	std::cerr << msg << std::endl;
@@ -147,5 +266,10 @@ void CommandLineUI::usage()
 	     << "  -r <#>      set recursion level (default " << m_nDepth << ")" << endl
 	     << "  -w <#>      set output image width (default " << m_nSize << ")" << endl
 	     << "  -j <FILE>   set parameters from JSON file" << endl
-	     << "  -c <FILE>   one Cubemap file, the remainings will be detected automatically" << endl;
+	     << "  -c <FILE>   one Cubemap file, the remainings will be detected automatically" << endl
+	     << "  -A <NAME>   acceleration structure, kdtree (default), bvh, bvh4, grid or auto" << endl
+	     << "  -C <DIR>    cache built acceleration structures in DIR" << endl
+	     << "  -R <FILE>   write a JSON report on the acceleration structures built to FILE" << endl
+	     << "  -m <I,X,Y,Z> move object I by (X,Y,Z) after loading, in " << kMoveSteps << " updates" << endl
+	     << "  -b          print timing and acceleration structure statistics" << endl;
 }
@@ -7,6 +7,8 @@
 #ifndef __CommandLineUI_h__
 #define __CommandLineUI_h__
 
+#include <glm/vec3.hpp>
+
 #include "TraceUI.h"
 
 class CommandLineUI : public TraceUI {
@@ -19,10 +21,17 @@ public:
 
 private:
 	void		usage();
+	double		moveObject();
 
 	char*	rayName;
 	char*	imgName;
 	char*	progName;
+	// print load and trace time, Mrays/s, allocations during the trace,
+	// statistics of the acceleration structures built and the triangle
+	// test timings
+	bool	m_benchmark = false;
+	int	m_moveObject = -1;	// object moved after loading (-m), if any
+	glm::dvec3	m_moveBy;	// by how much, in its parent's space
 };
 
 #endif
@@ -43,6 +43,41 @@ void TraceUI::setCubeMap(CubeMap* cm)
 	cubemap.reset(cm);
 }
 
+bool TraceUI::setAccelerator(const string& name)
+{
+	if (name == "kdtree")
+		m_accel = ACCEL_KDTREE;
+	else if (name == "bvh")
+		m_accel = ACCEL_BVH;
+	else if (name == "bvh4")
+		m_accel = ACCEL_BVH4;
+	else if (name == "grid")
+		m_accel = ACCEL_GRID;
+	else if (name == "auto")
+		m_accel = ACCEL_AUTO;
+	else
+		return false;
+	return true;
+}
+
+const char* TraceUI::acceleratorName(AccelType type)
+{
+	switch (type)
+	{
+	case ACCEL_BVH:
+		return "bvh";
+	case ACCEL_BVH4:
+		return "bvh4";
+	case ACCEL_GRID:
+		return "grid";
+	case ACCEL_AUTO:
+		return "auto";
+	case ACCEL_KDTREE:
+	default:
+		return "kdtree";
+	}
+}
+
 void TraceUI::loadFromJson(const char* file)
 {
 	std::ifstream fin(file);
@@ -61,6 +96,18 @@ void TraceUI::loadFromJson(const char* file)
 	load(json, "filter_width", m_nFilterWidth);
 	load(json, "anti_alias", m_antiAlias);
 	load(json, "kdtree", m_kdTree);
+	load(json, "kd_sah", m_kdSah);
+	load(json, "kd_perfect_splits", m_kdPerfectSplits);
+	load(json, "kd_lazy", m_kdLazy);
+	load(json, "kd_autotune", m_kdAutotune);
+	load(json, "mesh_reorder", m_meshReorder);
+	load(json, "float_geometry", m_floatGeometry);
+	string accel;
+	load(json, "accelerator", accel);
+	if (!accel.empty() && !setAccelerator(accel))
+		std::cerr << "Unknown accelerator \"" << accel << "\"" << std::endl;
+	load(json, "accel_cache", m_accelCache);
+	load(json, "rebuild_threshold", m_rebuildThreshold);
 	load(json, "shadows", m_shadows);
 	load(json, "smoothshade", m_smoothshade);
 	load(json, "backface_culling", m_backface);
@@ -16,6 +16,17 @@ using std::string;
 class RayTracer;
 class CubeMap;
 
+// acceleration structures, see scene/accelerator.h
+enum AccelType
+{
+	ACCEL_KDTREE,
+	ACCEL_BVH,
+	ACCEL_BVH4,
+	ACCEL_GRID,
+	// chosen per structure, see chooseAccelerator()
+	ACCEL_AUTO
+};
+
 class TraceUI {
 public:
 	TraceUI();
@@ -43,6 +54,22 @@ public:
 	int getThreads() const { return m_threads; }
 	bool aaSwitch() const { return m_antiAlias; }
 	bool kdSwitch() const { return m_kdTree; }
+	bool kdSahSwitch() const { return m_kdSah; }
+	bool kdPerfectSplitsSwitch() const { return m_kdPerfectSplits; }
+	bool kdLazySwitch() const { return m_kdLazy; }
+	bool kdAutotuneSwitch() const { return m_kdAutotune; }
+	bool meshReorderSwitch() const { return m_meshReorder; }
+	bool floatGeometrySwitch() const { return m_floatGeometry; }
+	AccelType getAccelerator() const { return m_accel; }
+	// selects the acceleration structure by name, false if unknown
+	bool setAccelerator(const string& name);
+	static const char* acceleratorName(AccelType type);
+	// directory of the acceleration structure cache, empty if disabled
+	const string& getAccelCache() const { return m_accelCache; }
+	// file the acceleration structure report goes to, empty if none
+	const string& getAccelReport() const { return m_accelReport; }
+	// see Scene::updateTransforms()
+	double getRebuildThreshold() const { return m_rebuildThreshold; }
 	bool shadowSw() const { return m_shadows; }
 	
 	bool jitterSwitch() const { return m_jitter; }
@@ -122,6 +149,16 @@ protected:
 	bool m_adaptive = false;
 	bool m_jitter = false;
 	bool m_kdTree = true;        // use kd-tree?
+	bool m_kdSah = false;        // build the kd-tree with the surface area heuristic?
+	bool m_kdPerfectSplits = false; // clip objects to the cells of the SAH kd-tree?
+	bool m_kdLazy = false;       // split kd-tree nodes when rays first reach them?
+	bool m_kdAutotune = false;   // pick depth and leaf size per kd-tree?
+	bool m_meshReorder = true;   // sort mesh faces and vertices spatially on load?
+	bool m_floatGeometry = false; // keep mesh triangles in single precision?
+	AccelType m_accel = ACCEL_KDTREE; // structure built when m_kdTree is on
+	string m_accelCache;         // where built structures are cached, if anywhere
+	string m_accelReport;        // where the report on built structures goes, if anywhere
+	double m_rebuildThreshold = 1.5; // refit cost growth that triggers a rebuild, 0 for never
 	bool m_shadows = true;       // compute shadows?
 	bool m_smoothshade = true;   // turn on/off smoothshading?
 	bool m_backface = true;      // cull backfaces?
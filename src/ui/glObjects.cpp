@@ -354,9 +354,9 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 		glBegin( GL_TRIANGLES );
 		for( Faces::const_iterator itr = faces.begin(); itr != faces.end(); ++itr )
 		{
-			const int vert1 = (*(*itr))[0];
-			const int vert2 = (*(*itr))[1];
-			const int vert3 = (*(*itr))[2];
+			const int vert1 = (*itr)[0];
+			const int vert2 = (*itr)[1];
+			const int vert3 = (*itr)[2];
 
 			if( normals.empty() )
 			{
@@ -375,19 +375,19 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 			if( ! normals.empty() )
 				glNormal3dv( &normals[vert1][0] );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert1], *itr );
+				setGLMaterial( *materials[vert1], this );
 			glVertex3dv( &vertices[vert1][0] );
 
 			if( ! normals.empty() )
 				glNormal3dv( &normals[vert2][0] );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert2], *itr );
+				setGLMaterial( *materials[vert2], this );
 			glVertex3dv( &vertices[vert2][0] );
 
 			if( ! normals.empty() )
 				glNormal3dv( &normals[vert3][0] );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert3], *itr );
+				setGLMaterial( *materials[vert3], this );
 			glVertex3dv( &vertices[vert3][0] );
 		}
 		glEnd();
@@ -398,6 +398,13 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 	glCallList(displayList);
 }
 
+void TrimeshInstance::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+{
+	// the mesh's display lists are in local coordinates, so they serve
+	// every placement
+	mesh->glDrawLocal(quality, actualMaterials, actualTextures);
+}
+
 void PointLight::glDraw(GLenum lightID) const
 {
 